@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "composite.h"
+
+/* Compares the composite kernels against pixman, which is what the render
+ * pool and the wlroots pixman renderer use otherwise, on whole-surface
+ * operations of a few typical sizes. With -V it instead checks that every
+ * supported kernel table draws what pixman draws, on odd sizes and clip
+ * boxes that exercise the vector bodies, the scalar tails and odd scale
+ * phases. */
+
+enum bench_op
+{
+    BENCH_FILL,
+    BENCH_COPY,
+    BENCH_OVER,
+    BENCH_SCALE,
+    BENCH_OP_COUNT,
+};
+
+static const char *op_names[BENCH_OP_COUNT] = {
+        [BENCH_FILL] = "fill",
+        [BENCH_COPY] = "copy",
+        [BENCH_OVER] = "over",
+        [BENCH_SCALE] = "scale2x",
+};
+
+struct bench_case
+{
+    pixman_image_t *dst;
+    pixman_image_t *opaque;
+    pixman_image_t *translucent;
+    pixman_image_t *half;
+    int width, height;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pixman_image_t *create_image(pixman_format_code_t format, int width, int height, bool translucent)
+{
+    pixman_image_t *image = pixman_image_create_bits(format, width, height, NULL, width * 4);
+    uint32_t *data = pixman_image_get_data(image);
+    uint32_t seed = 0x12345678;
+    for (int i = 0; i < width * height; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t pixel = seed >> 8;
+        if (translucent)
+        {
+            /* Premultiplied, with runs of fully transparent and opaque pixels
+             * like a decorated window with a drop shadow. */
+            uint32_t alpha = (i / 64) % 4 == 0 ? 0 : (i / 64) % 4 == 1 ? 255 : seed >> 24;
+            pixel = alpha << 24 | ((pixel >> 16 & 0xff) * alpha / 255) << 16 |
+                    ((pixel >> 8 & 0xff) * alpha / 255) << 8 | (pixel & 0xff) * alpha / 255;
+        }
+        data[i] = pixel;
+    }
+    return image;
+}
+
+static void bench_case_init(struct bench_case *c, int width, int height)
+{
+    *c = (struct bench_case){
+            .width = width,
+            .height = height,
+            .dst = create_image(PIXMAN_x8r8g8b8, width, height, false),
+            .opaque = create_image(PIXMAN_x8r8g8b8, width, height, false),
+            .translucent = create_image(PIXMAN_a8r8g8b8, width, height, true),
+            .half = create_image(PIXMAN_x8r8g8b8, (width + 1) / 2, (height + 1) / 2, false),
+    };
+    pixman_transform_t transform;
+    pixman_transform_init_scale(&transform, pixman_double_to_fixed(0.5), pixman_double_to_fixed(0.5));
+    pixman_image_set_transform(c->half, &transform);
+    pixman_image_set_filter(c->half, PIXMAN_FILTER_NEAREST, NULL, 0);
+}
+
+static void bench_case_finish(struct bench_case *c)
+{
+    pixman_image_unref(c->dst);
+    pixman_image_unref(c->opaque);
+    pixman_image_unref(c->translucent);
+    pixman_image_unref(c->half);
+}
+
+/* Both draw the sources at the origin, clipped to box. */
+static void run_pixman(struct bench_case *c, enum bench_op op, const pixman_box32_t *box)
+{
+    pixman_color_t black = { .red = 0, .green = 0, .blue = 0, .alpha = 0xffff };
+    int width = box->x2 - box->x1, height = box->y2 - box->y1;
+    switch (op)
+    {
+        case BENCH_FILL:
+            pixman_image_fill_boxes(PIXMAN_OP_SRC, c->dst, &black, 1, box);
+            break;
+        case BENCH_COPY:
+            pixman_image_composite32(PIXMAN_OP_SRC, c->opaque, NULL, c->dst, box->x1, box->y1, 0, 0,
+                    box->x1, box->y1, width, height);
+            break;
+        case BENCH_OVER:
+            pixman_image_composite32(PIXMAN_OP_OVER, c->translucent, NULL, c->dst, box->x1, box->y1, 0, 0,
+                    box->x1, box->y1, width, height);
+            break;
+        case BENCH_SCALE:
+            pixman_image_composite32(PIXMAN_OP_SRC, c->half, NULL, c->dst, box->x1, box->y1, 0, 0,
+                    box->x1, box->y1, width, height);
+            break;
+        default:
+            break;
+    }
+}
+
+static void run_kernels(struct bench_case *c, const struct miniwl_composite_ops *ops, enum bench_op op,
+        const pixman_box32_t *box)
+{
+    switch (op)
+    {
+        case BENCH_FILL:
+            miniwl_composite_fill(ops, c->dst, box, 0xff000000);
+            break;
+        case BENCH_COPY:
+            miniwl_composite_blit(ops, c->dst, c->opaque, 0, 0, 1, box);
+            break;
+        case BENCH_OVER:
+            miniwl_composite_blit(ops, c->dst, c->translucent, 0, 0, 1, box);
+            break;
+        case BENCH_SCALE:
+            miniwl_composite_blit(ops, c->dst, c->half, 0, 0, 2, box);
+            break;
+        default:
+            break;
+    }
+}
+
+static void run(struct bench_case *c, const struct miniwl_composite_ops *ops, enum bench_op op)
+{
+    pixman_box32_t box = { 0, 0, c->width, c->height };
+    if (ops != NULL)
+    {
+        run_kernels(c, ops, op, &box);
+    }
+    else
+    {
+        run_pixman(c, op, &box);
+    }
+}
+
+/* Returns megapixels per second, repeating the operation for at least the
+ * given time after one warm-up run. */
+static double measure(struct bench_case *c, const struct miniwl_composite_ops *ops, enum bench_op op, double seconds)
+{
+    run(c, ops, op);
+    long iterations = 0;
+    double begin = now_s(), elapsed;
+    do
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            run(c, ops, op);
+        }
+        iterations += 8;
+        elapsed = now_s() - begin;
+    } while (elapsed < seconds);
+    return (double)c->width * c->height * iterations / elapsed / 1e6;
+}
+
+static void bench_size(int width, int height, double seconds)
+{
+    struct bench_case c;
+    bench_case_init(&c, width, height);
+
+    size_t count;
+    const struct miniwl_composite_ops *const *list = miniwl_composite_ops_list(&count);
+    for (int op = 0; op < BENCH_OP_COUNT; op++)
+    {
+        double base = measure(&c, NULL, op, seconds);
+        printf("%-8s %5dx%-5d %-8s %10.1f Mpix/s\n", op_names[op], width, height, "pixman", base);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!list[i]->supported())
+            {
+                continue;
+            }
+            double rate = measure(&c, list[i], op, seconds);
+            printf("%-8s %5dx%-5d %-8s %10.1f Mpix/s  %5.2fx\n", op_names[op], width, height, list[i]->name,
+                    rate, rate / base);
+        }
+    }
+    bench_case_finish(&c);
+}
+
+/* The destination is x8r8g8b8, whose padding byte neither side defines. */
+static bool pixel_matches(uint32_t got, uint32_t want)
+{
+    return (got & 0x00ffffff) == (want & 0x00ffffff);
+}
+
+/* Returns the number of mismatching (operation, box, table) combinations. */
+static int verify_size(int width, int height)
+{
+    struct bench_case c;
+    bench_case_init(&c, width, height);
+    size_t npixels = (size_t)width * height;
+    uint32_t *dst = pixman_image_get_data(c.dst);
+    uint32_t *initial = malloc(npixels * sizeof(uint32_t));
+    uint32_t *expected = malloc(npixels * sizeof(uint32_t));
+    memcpy(initial, dst, npixels * sizeof(uint32_t));
+
+    size_t count;
+    const struct miniwl_composite_ops *const *list = miniwl_composite_ops_list(&count);
+    int failures = 0;
+    /* The whole surface, then a box clipped by one pixel on the left and
+     * top, which starts the scale on an odd phase and shifts every tail. */
+    for (int inset = 0; inset < 2; inset++)
+    {
+        pixman_box32_t box = { inset, inset, width, height };
+        if (box.x1 >= box.x2 || box.y1 >= box.y2)
+        {
+            continue;
+        }
+        for (int op = 0; op < BENCH_OP_COUNT; op++)
+        {
+            memcpy(dst, initial, npixels * sizeof(uint32_t));
+            run_pixman(&c, op, &box);
+            memcpy(expected, dst, npixels * sizeof(uint32_t));
+            for (size_t i = 0; i < count; i++)
+            {
+                if (!list[i]->supported())
+                {
+                    continue;
+                }
+                memcpy(dst, initial, npixels * sizeof(uint32_t));
+                run_kernels(&c, list[i], op, &box);
+                for (size_t p = 0; p < npixels; p++)
+                {
+                    if (!pixel_matches(dst[p], expected[p]))
+                    {
+                        printf("FAIL %-8s %3dx%-3d box %d,%d %-8s at %zu,%zu: %08x, pixman %08x\n", op_names[op],
+                                width, height, box.x1, box.y1, list[i]->name, p % width, p / width,
+                                dst[p], expected[p]);
+                        failures++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    free(initial);
+    free(expected);
+    bench_case_finish(&c);
+    return failures;
+}
+
+static int verify(void)
+{
+    /* Around every vector width (4 and 8 pixels, 8 and 16 scaled) so both
+     * the vector loops and the scalar tails run, plus a few odd sizes. */
+    static const int sizes[][2] = {
+            { 1, 1 }, { 2, 2 }, { 3, 5 }, { 4, 1 }, { 5, 3 }, { 7, 2 }, { 8, 3 }, { 9, 4 }, { 15, 2 },
+            { 16, 3 }, { 17, 5 }, { 31, 3 }, { 33, 2 }, { 63, 7 }, { 67, 9 }, { 641, 3 },
+    };
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        failures += verify_size(sizes[i][0], sizes[i][1]);
+    }
+
+    size_t count;
+    const struct miniwl_composite_ops *const *list = miniwl_composite_ops_list(&count);
+    for (size_t i = 0; i < count; i++)
+    {
+        printf("%-8s %s\n", list[i]->name, !list[i]->supported() ? "not supported, skipped" : "checked");
+    }
+    printf("%s: %d mismatch%s\n", failures == 0 ? "ok" : "FAILED", failures, failures == 1 ? "" : "es");
+    return failures == 0 ? 0 : 1;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-s WIDTHxHEIGHT] [-t seconds per case] [-V]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    /* An icon, a small dialog, a typical window, full HD and 4K. */
+    int sizes[][2] = { { 64, 64 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    double seconds = 0.25;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:t:Vh")) != -1)
+    {
+        switch (c)
+        {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &sizes[0][0], &sizes[0][1]) != 2 || sizes[0][0] < 2 || sizes[0][1] < 2)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                nsizes = 1;
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'V':
+                return verify();
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    printf("default kernels: %s\n", miniwl_composite_get()->name);
+    for (int i = 0; i < nsizes; i++)
+    {
+        bench_size(sizes[i][0], sizes[i][1], seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,1603 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
+#include <wayland-client.h>
+#include <xkbcommon/xkbcommon.h>
+#include "xdg-shell-client-protocol.h"
+#include "wlr-virtual-pointer-unstable-v1-client-protocol.h"
+#include "virtual-keyboard-unstable-v1-client-protocol.h"
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+
+#define BENCH_INPUT_QUEUE 1024
+
+struct bench_stats
+{
+    double *samples;
+    size_t len, cap;
+};
+
+struct bench_input_queue
+{
+    double stamps[BENCH_INPUT_QUEUE];
+    size_t head, len;
+};
+
+struct bench_buffer
+{
+    struct wl_buffer *wl_buffer;
+    uint32_t *data;
+    bool busy;
+};
+
+struct bench_client
+{
+    struct bench *bench;
+    struct wl_display *display;
+    struct wl_registry *registry;
+    struct wl_compositor *compositor;
+    struct wl_shm *shm;
+    struct xdg_wm_base *wm_base;
+    struct wl_seat *seat;
+    struct wl_pointer *pointer;
+    struct wl_keyboard *keyboard;
+    struct zwlr_virtual_pointer_manager_v1 *pointer_mgr;
+    struct zwp_virtual_keyboard_manager_v1 *keyboard_mgr;
+    struct zwlr_screencopy_manager_v1 *screencopy_mgr;
+    uint32_t screencopy_version;
+    struct wl_output *output;
+
+    struct wl_surface *surface;
+    struct xdg_surface *xdg_surface;
+    struct xdg_toplevel *xdg_toplevel;
+    struct wl_callback *frame_callback;
+    struct bench_buffer buffers[2];
+    void *buffer_data;
+    size_t buffer_size;
+    int buffer_width, buffer_height;
+    /* Size of the next commit; zero until a replayed client has one. */
+    int width, height;
+    bool configured;
+
+    double next_commit;
+    double last_commit;
+    double last_frame;
+    double pending_input;
+    double inflight_input;
+    uint32_t color;
+};
+
+/* A recorder on the first client's connection: copy_with_damage in a loop,
+ * so an idle desktop should produce no copies at all. */
+struct bench_capture
+{
+    bool enabled;
+    struct zwlr_screencopy_frame_v1 *frame;
+    struct wl_buffer *wl_buffer;
+    void *data;
+    size_t size;
+    uint32_t format;
+    int width, height, stride;
+    double last_ready;
+    unsigned long frames;
+    unsigned long failures;
+    unsigned long damage_rects;
+    struct bench_stats interval;
+};
+
+enum bench_replay_type
+{
+    REPLAY_MOTION,
+    REPLAY_MOTION_ABSOLUTE,
+    REPLAY_BUTTON,
+    REPLAY_AXIS,
+    REPLAY_KEY,
+    REPLAY_TOPLEVEL,
+    REPLAY_UNMAP,
+    REPLAY_DESTROY,
+    REPLAY_FULLSCREEN,
+    REPLAY_COMMIT,
+};
+
+struct bench_replay_event
+{
+    double time;
+    enum bench_replay_type type;
+    /* View events carry the view id first, see trace.h. */
+    double args[8];
+};
+
+/* A miniwl -R trace played back with one stand-in client per recorded
+ * toplevel and clients[0] as the input and capture connection. */
+struct bench_replay
+{
+    const char *path;
+    struct bench_replay_event *events;
+    size_t len, next;
+};
+
+struct bench
+{
+    int nclients;
+    int width, height;
+    double commit_rate;
+    double input_rate;
+    double key_rate;
+    double duration;
+    bool fullscreen;
+    const char *output_path;
+
+    struct bench_client *clients;
+    struct zwlr_virtual_pointer_v1 *virtual_pointer;
+    struct zwp_virtual_keyboard_v1 *virtual_keyboard;
+    pid_t compositor_pid;
+    bool running;
+    double start, end;
+    double next_motion, next_key;
+    int motion_dir;
+
+    struct bench_input_queue motions;
+    struct bench_input_queue keys;
+
+    unsigned long frames;
+    unsigned long commits;
+    unsigned long throttled;
+    struct bench_stats frame_interval;
+    struct bench_stats commit_to_frame;
+    struct bench_stats input_dispatch;
+    struct bench_stats key_dispatch;
+    struct bench_stats input_to_present;
+    struct bench_capture capture;
+    struct bench_replay replay;
+};
+
+struct proc_sample
+{
+    double utime, stime;
+    long rss_kb, hwm_kb;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void stats_add(struct bench_stats *stats, double value)
+{
+    if (stats->len == stats->cap)
+    {
+        size_t cap = stats->cap ? stats->cap * 2 : 1024;
+        double *samples = realloc(stats->samples, cap * sizeof(double));
+        if (samples == NULL)
+        {
+            return;
+        }
+        stats->samples = samples;
+        stats->cap = cap;
+    }
+    stats->samples[stats->len++] = value;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static double stats_percentile(struct bench_stats *stats, double p)
+{
+    if (stats->len == 0)
+    {
+        return 0;
+    }
+    size_t rank = (size_t)(p / 100.0 * (stats->len - 1) + 0.5);
+    return stats->samples[rank];
+}
+
+static void stats_print(FILE *f, const char *name, struct bench_stats *stats, bool last)
+{
+    qsort(stats->samples, stats->len, sizeof(double), compare_double);
+    double sum = 0;
+    for (size_t i = 0; i < stats->len; i++)
+    {
+        sum += stats->samples[i];
+    }
+    fprintf(f, "  \"%s\": {\"count\": %zu, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+            "\"p99\": %.3f, \"max\": %.3f}%s\n",
+            name, stats->len, stats->len ? sum / stats->len : 0,
+            stats_percentile(stats, 50), stats_percentile(stats, 90),
+            stats_percentile(stats, 99), stats_percentile(stats, 100), last ? "" : ",");
+}
+
+static void queue_push(struct bench_input_queue *queue, double stamp)
+{
+    if (queue->len == BENCH_INPUT_QUEUE)
+    {
+        queue->head = (queue->head + 1) % BENCH_INPUT_QUEUE;
+        queue->len--;
+    }
+    queue->stamps[(queue->head + queue->len) % BENCH_INPUT_QUEUE] = stamp;
+    queue->len++;
+}
+
+static double queue_pop(struct bench_input_queue *queue)
+{
+    if (queue->len == 0)
+    {
+        return 0;
+    }
+    double stamp = queue->stamps[queue->head];
+    queue->head = (queue->head + 1) % BENCH_INPUT_QUEUE;
+    queue->len--;
+    return stamp;
+}
+
+static bool proc_sample(pid_t pid, struct proc_sample *sample)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* The command name may contain spaces, so parse from its closing paren. */
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*lu %*lu %*lu %*lu %lu %lu",
+            &utime, &stime) != 2)
+    {
+        return false;
+    }
+    long ticks = sysconf(_SC_CLK_TCK);
+    sample->utime = (double)utime / ticks;
+    sample->stime = (double)stime / ticks;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    while (fgets(buf, sizeof(buf), f) != NULL)
+    {
+        sscanf(buf, "VmRSS: %ld", &sample->rss_kb);
+        sscanf(buf, "VmHWM: %ld", &sample->hwm_kb);
+    }
+    fclose(f);
+    return true;
+}
+
+static char *compositor_metrics(void)
+{
+    /* miniwl exports its stats socket to the clients it starts. */
+    const char *path = getenv("MINIWL_STATS_SOCKET");
+    if (path == NULL || path[0] == '\0')
+    {
+        return NULL;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || write(fd, "metrics\n", 8) != 8)
+    {
+        close(fd);
+        return NULL;
+    }
+    char *text = NULL;
+    size_t len = 0, size = 0;
+    for (;;)
+    {
+        if (size - len < 4096)
+        {
+            size = size * 2 + 4096;
+            char *grown = realloc(text, size);
+            if (grown == NULL)
+            {
+                break;
+            }
+            text = grown;
+        }
+        ssize_t n = read(fd, text + len, size - len - 1);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    if (text != NULL)
+    {
+        text[len] = '\0';
+    }
+    return text;
+}
+
+/* Sums a counter over all its label sets, e.g. every output. */
+static unsigned long metrics_counter(const char *text, const char *name)
+{
+    unsigned long sum = 0;
+    size_t len = strlen(name);
+    const char *line = text;
+    while (line != NULL && *line != '\0')
+    {
+        if (strncmp(line, name, len) == 0 && (line[len] == '{' || line[len] == ' '))
+        {
+            const char *value = strchr(line + len, ' ');
+            if (value != NULL)
+            {
+                sum += strtoul(value + 1, NULL, 10);
+            }
+        }
+        line = strchr(line, '\n');
+        if (line != NULL)
+        {
+            line++;
+        }
+    }
+    return sum;
+}
+
+static int create_shm_file(size_t size)
+{
+    int fd = memfd_create("miniwl-bench", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+    struct bench_buffer *buffer = data;
+    buffer->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+        .release = buffer_release,
+};
+
+static void client_destroy_buffers(struct bench_client *client)
+{
+    if (client->buffer_data == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        wl_buffer_destroy(client->buffers[i].wl_buffer);
+        client->buffers[i] = (struct bench_buffer){0};
+    }
+    munmap(client->buffer_data, client->buffer_size);
+    client->buffer_data = NULL;
+}
+
+static bool client_create_buffers(struct bench_client *client)
+{
+    if (client->buffer_data != NULL && client->buffer_width == client->width &&
+            client->buffer_height == client->height)
+    {
+        return true;
+    }
+    client_destroy_buffers(client);
+    int stride = client->width * 4;
+    size_t size = (size_t)stride * client->height;
+
+    int fd = create_shm_file(size * 2);
+    if (fd < 0)
+    {
+        return false;
+    }
+    void *data = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(client->shm, fd, size * 2);
+    for (int i = 0; i < 2; i++)
+    {
+        struct bench_buffer *buffer = &client->buffers[i];
+        buffer->wl_buffer = wl_shm_pool_create_buffer(pool, size * i,
+                client->width, client->height, stride, WL_SHM_FORMAT_XRGB8888);
+        buffer->data = (uint32_t *)((char *)data + size * i);
+        wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+    }
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    client->buffer_data = data;
+    client->buffer_size = size * 2;
+    client->buffer_width = client->width;
+    client->buffer_height = client->height;
+    return true;
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time);
+
+static const struct wl_callback_listener frame_listener = {
+        .done = frame_done,
+};
+
+/* Commits a new frame with the given buffer damage; only the damaged box is
+ * redrawn. */
+static void client_commit(struct bench_client *client, double now, int x, int y, int width, int height)
+{
+    struct bench *bench = client->bench;
+    if (!client_create_buffers(client))
+    {
+        fprintf(stderr, "failed to allocate shm buffers: %s\n", strerror(errno));
+        return;
+    }
+    struct bench_buffer *buffer = NULL;
+    for (int i = 0; i < 2; i++)
+    {
+        if (!client->buffers[i].busy)
+        {
+            buffer = &client->buffers[i];
+            break;
+        }
+    }
+    if (buffer == NULL || client->frame_callback != NULL)
+    {
+        bench->throttled++;
+        return;
+    }
+
+    client->color += 0x010203;
+    for (int row = y; row < y + height; row++)
+    {
+        uint32_t *line = buffer->data + (size_t)row * client->width;
+        for (int col = x; col < x + width; col++)
+        {
+            line[col] = client->color;
+        }
+    }
+
+    wl_surface_attach(client->surface, buffer->wl_buffer, 0, 0);
+    wl_surface_damage_buffer(client->surface, x, y, width, height);
+    client->frame_callback = wl_surface_frame(client->surface);
+    wl_callback_add_listener(client->frame_callback, &frame_listener, client);
+    wl_surface_commit(client->surface);
+    buffer->busy = true;
+
+    client->inflight_input = client->pending_input;
+    client->pending_input = 0;
+    client->last_commit = now;
+    bench->commits++;
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+    struct bench_client *client = data;
+    struct bench *bench = client->bench;
+    double now = now_ms();
+
+    wl_callback_destroy(callback);
+    client->frame_callback = NULL;
+    if (!bench->running)
+    {
+        return;
+    }
+
+    bench->frames++;
+    stats_add(&bench->commit_to_frame, now - client->last_commit);
+    if (client->last_frame > 0)
+    {
+        stats_add(&bench->frame_interval, now - client->last_frame);
+    }
+    client->last_frame = now;
+    if (client->inflight_input > 0)
+    {
+        stats_add(&bench->input_to_present, now - client->inflight_input);
+        client->inflight_input = 0;
+    }
+}
+
+static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
+{
+    struct bench_client *client = data;
+    xdg_surface_ack_configure(xdg_surface, serial);
+    if (!client->configured)
+    {
+        client->configured = true;
+        if (client->width > 0)
+        {
+            client_commit(client, now_ms(), 0, 0, client->width, client->height);
+        }
+    }
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+        .configure = xdg_surface_configure,
+};
+
+static void xdg_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+        int32_t width, int32_t height, struct wl_array *states)
+{
+}
+
+static void xdg_toplevel_close(void *data, struct xdg_toplevel *toplevel)
+{
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+        .configure = xdg_toplevel_configure,
+        .close = xdg_toplevel_close,
+};
+
+static void wm_base_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial)
+{
+    xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+        .ping = wm_base_ping,
+};
+
+static void pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial,
+        struct wl_surface *surface, wl_fixed_t sx, wl_fixed_t sy)
+{
+}
+
+static void pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial,
+        struct wl_surface *surface)
+{
+    struct bench_client *client = data;
+    client->bench->motions.len = 0;
+}
+
+static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
+        wl_fixed_t sx, wl_fixed_t sy)
+{
+    struct bench_client *client = data;
+    struct bench *bench = client->bench;
+    double stamp = queue_pop(&bench->motions);
+    if (stamp <= 0 || !bench->running)
+    {
+        return;
+    }
+    stats_add(&bench->input_dispatch, now_ms() - stamp);
+    if (client->pending_input == 0)
+    {
+        client->pending_input = stamp;
+    }
+}
+
+static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial,
+        uint32_t time, uint32_t button, uint32_t state)
+{
+}
+
+static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time,
+        uint32_t axis, wl_fixed_t value)
+{
+}
+
+static void pointer_frame(void *data, struct wl_pointer *pointer)
+{
+}
+
+static void pointer_axis_source(void *data, struct wl_pointer *pointer, uint32_t source)
+{
+}
+
+static void pointer_axis_stop(void *data, struct wl_pointer *pointer, uint32_t time, uint32_t axis)
+{
+}
+
+static void pointer_axis_discrete(void *data, struct wl_pointer *pointer, uint32_t axis, int32_t discrete)
+{
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+        .enter = pointer_enter,
+        .leave = pointer_leave,
+        .motion = pointer_motion,
+        .button = pointer_button,
+        .axis = pointer_axis,
+        .frame = pointer_frame,
+        .axis_source = pointer_axis_source,
+        .axis_stop = pointer_axis_stop,
+        .axis_discrete = pointer_axis_discrete,
+};
+
+static void keyboard_keymap(void *data, struct wl_keyboard *keyboard, uint32_t format,
+        int32_t fd, uint32_t size)
+{
+    close(fd);
+}
+
+static void keyboard_enter(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+        struct wl_surface *surface, struct wl_array *keys)
+{
+}
+
+static void keyboard_leave(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+        struct wl_surface *surface)
+{
+    struct bench_client *client = data;
+    client->bench->keys.len = 0;
+}
+
+static void keyboard_key(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+        uint32_t time, uint32_t key, uint32_t state)
+{
+    struct bench_client *client = data;
+    struct bench *bench = client->bench;
+    if (state != WL_KEYBOARD_KEY_STATE_PRESSED)
+    {
+        return;
+    }
+    double stamp = queue_pop(&bench->keys);
+    if (stamp > 0 && bench->running)
+    {
+        stats_add(&bench->key_dispatch, now_ms() - stamp);
+    }
+}
+
+static void keyboard_modifiers(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+        uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group)
+{
+}
+
+static void keyboard_repeat_info(void *data, struct wl_keyboard *keyboard, int32_t rate, int32_t delay)
+{
+}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+        .keymap = keyboard_keymap,
+        .enter = keyboard_enter,
+        .leave = keyboard_leave,
+        .key = keyboard_key,
+        .modifiers = keyboard_modifiers,
+        .repeat_info = keyboard_repeat_info,
+};
+
+static void seat_capabilities(void *data, struct wl_seat *seat, uint32_t caps)
+{
+    struct bench_client *client = data;
+    if ((caps & WL_SEAT_CAPABILITY_POINTER) && client->pointer == NULL)
+    {
+        client->pointer = wl_seat_get_pointer(seat);
+        wl_pointer_add_listener(client->pointer, &pointer_listener, client);
+    }
+    if ((caps & WL_SEAT_CAPABILITY_KEYBOARD) && client->keyboard == NULL)
+    {
+        client->keyboard = wl_seat_get_keyboard(seat);
+        wl_keyboard_add_listener(client->keyboard, &keyboard_listener, client);
+    }
+}
+
+static void seat_name(void *data, struct wl_seat *seat, const char *name)
+{
+}
+
+static const struct wl_seat_listener seat_listener = {
+        .capabilities = seat_capabilities,
+        .name = seat_name,
+};
+
+static void capture_start(struct bench *bench);
+
+static bool capture_create_buffer(struct bench *bench)
+{
+    struct bench_capture *capture = &bench->capture;
+    size_t size = (size_t)capture->stride * capture->height;
+    if (capture->wl_buffer != NULL && capture->size == size)
+    {
+        return true;
+    }
+    if (capture->wl_buffer != NULL)
+    {
+        wl_buffer_destroy(capture->wl_buffer);
+        munmap(capture->data, capture->size);
+        capture->wl_buffer = NULL;
+    }
+
+    int fd = create_shm_file(size);
+    if (fd < 0)
+    {
+        return false;
+    }
+    capture->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (capture->data == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    struct wl_shm_pool *pool = wl_shm_create_pool(bench->clients[0].shm, fd, size);
+    capture->wl_buffer = wl_shm_pool_create_buffer(pool, 0, capture->width, capture->height,
+            capture->stride, capture->format);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    capture->size = size;
+    return true;
+}
+
+static void capture_copy(struct bench *bench)
+{
+    struct bench_capture *capture = &bench->capture;
+    if (!capture_create_buffer(bench))
+    {
+        fprintf(stderr, "failed to allocate the capture buffer: %s\n", strerror(errno));
+        zwlr_screencopy_frame_v1_destroy(capture->frame);
+        capture->frame = NULL;
+        return;
+    }
+    zwlr_screencopy_frame_v1_copy_with_damage(capture->frame, capture->wl_buffer);
+}
+
+static void capture_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t format, uint32_t width, uint32_t height, uint32_t stride)
+{
+    struct bench *bench = data;
+    bench->capture.format = format;
+    bench->capture.width = width;
+    bench->capture.height = height;
+    bench->capture.stride = stride;
+    /* buffer_done only exists from version 3 on. */
+    if (bench->clients[0].screencopy_version < 3)
+    {
+        capture_copy(bench);
+    }
+}
+
+static void capture_flags(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags)
+{
+}
+
+static void capture_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec)
+{
+    struct bench *bench = data;
+    struct bench_capture *capture = &bench->capture;
+    double now = now_ms();
+    zwlr_screencopy_frame_v1_destroy(frame);
+    capture->frame = NULL;
+    if (bench->running)
+    {
+        capture->frames++;
+        if (capture->last_ready > 0)
+        {
+            stats_add(&capture->interval, now - capture->last_ready);
+        }
+        capture->last_ready = now;
+    }
+    capture_start(bench);
+}
+
+static void capture_failed(void *data, struct zwlr_screencopy_frame_v1 *frame)
+{
+    struct bench *bench = data;
+    zwlr_screencopy_frame_v1_destroy(frame);
+    bench->capture.frame = NULL;
+    bench->capture.failures++;
+    /* Give up rather than spin on a compositor that cannot capture. */
+    if (bench->capture.failures < 10)
+    {
+        capture_start(bench);
+    }
+}
+
+static void capture_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    struct bench *bench = data;
+    if (bench->running)
+    {
+        bench->capture.damage_rects++;
+    }
+}
+
+static void capture_linux_dmabuf(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t format, uint32_t width, uint32_t height)
+{
+}
+
+static void capture_buffer_done(void *data, struct zwlr_screencopy_frame_v1 *frame)
+{
+    capture_copy(data);
+}
+
+static const struct zwlr_screencopy_frame_v1_listener capture_listener = {
+        .buffer = capture_buffer,
+        .flags = capture_flags,
+        .ready = capture_ready,
+        .failed = capture_failed,
+        .damage = capture_damage,
+        .linux_dmabuf = capture_linux_dmabuf,
+        .buffer_done = capture_buffer_done,
+};
+
+static void capture_start(struct bench *bench)
+{
+    struct bench_client *client = &bench->clients[0];
+    bench->capture.frame = zwlr_screencopy_manager_v1_capture_output(client->screencopy_mgr, 0, client->output);
+    zwlr_screencopy_frame_v1_add_listener(bench->capture.frame, &capture_listener, bench);
+}
+
+static void registry_global(void *data, struct wl_registry *registry, uint32_t name,
+        const char *interface, uint32_t version)
+{
+    struct bench_client *client = data;
+    if (strcmp(interface, wl_compositor_interface.name) == 0)
+    {
+        client->compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+    }
+    else if (strcmp(interface, wl_shm_interface.name) == 0)
+    {
+        client->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    }
+    else if (strcmp(interface, xdg_wm_base_interface.name) == 0)
+    {
+        client->wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+        xdg_wm_base_add_listener(client->wm_base, &wm_base_listener, client);
+    }
+    else if (strcmp(interface, wl_seat_interface.name) == 0 && client->seat == NULL)
+    {
+        client->seat = wl_registry_bind(registry, name, &wl_seat_interface, 5);
+        wl_seat_add_listener(client->seat, &seat_listener, client);
+    }
+    else if (strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0)
+    {
+        client->pointer_mgr = wl_registry_bind(registry, name, &zwlr_virtual_pointer_manager_v1_interface, 1);
+    }
+    else if (strcmp(interface, zwp_virtual_keyboard_manager_v1_interface.name) == 0)
+    {
+        client->keyboard_mgr = wl_registry_bind(registry, name, &zwp_virtual_keyboard_manager_v1_interface, 1);
+    }
+    else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0)
+    {
+        client->screencopy_version = version < 3 ? version : 3;
+        client->screencopy_mgr = wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface,
+                client->screencopy_version);
+    }
+    else if (strcmp(interface, wl_output_interface.name) == 0 && client->output == NULL)
+    {
+        client->output = wl_registry_bind(registry, name, &wl_output_interface, 1);
+    }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+        .global = registry_global,
+        .global_remove = registry_global_remove,
+};
+
+static bool client_connect(struct bench_client *client)
+{
+    client->display = wl_display_connect(NULL);
+    if (client->display == NULL)
+    {
+        fprintf(stderr, "failed to connect to the compositor\n");
+        return false;
+    }
+    client->registry = wl_display_get_registry(client->display);
+    wl_registry_add_listener(client->registry, &registry_listener, client);
+    wl_display_roundtrip(client->display);
+    if (client->compositor == NULL || client->shm == NULL || client->wm_base == NULL)
+    {
+        fprintf(stderr, "compositor is missing wl_compositor, wl_shm or xdg_wm_base\n");
+        return false;
+    }
+    return true;
+}
+
+static void client_create_toplevel(struct bench_client *client)
+{
+    client->surface = wl_compositor_create_surface(client->compositor);
+    client->xdg_surface = xdg_wm_base_get_xdg_surface(client->wm_base, client->surface);
+    xdg_surface_add_listener(client->xdg_surface, &xdg_surface_listener, client);
+    client->xdg_toplevel = xdg_surface_get_toplevel(client->xdg_surface);
+    xdg_toplevel_add_listener(client->xdg_toplevel, &xdg_toplevel_listener, client);
+    xdg_toplevel_set_title(client->xdg_toplevel, "miniwl-bench");
+    if (client->bench->fullscreen)
+    {
+        xdg_toplevel_set_fullscreen(client->xdg_toplevel, NULL);
+    }
+    wl_surface_commit(client->surface);
+}
+
+static void client_disconnect(struct bench_client *client)
+{
+    if (client->display == NULL)
+    {
+        return;
+    }
+    client_destroy_buffers(client);
+    wl_display_disconnect(client->display);
+    struct bench *bench = client->bench;
+    *client = (struct bench_client){ .bench = bench };
+}
+
+static bool bench_create_input(struct bench *bench)
+{
+    struct bench_client *client = &bench->clients[0];
+    if (client->pointer_mgr == NULL || client->keyboard_mgr == NULL || client->seat == NULL)
+    {
+        fprintf(stderr, "compositor does not support virtual pointer/keyboard, input disabled\n");
+        return false;
+    }
+    bench->virtual_pointer = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(client->pointer_mgr, client->seat);
+    bench->virtual_keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(client->keyboard_mgr, client->seat);
+
+    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    char *string = keymap ? xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1) : NULL;
+    if (string != NULL)
+    {
+        size_t size = strlen(string) + 1;
+        int fd = create_shm_file(size);
+        if (fd >= 0 && write(fd, string, size) == (ssize_t)size)
+        {
+            zwp_virtual_keyboard_v1_keymap(bench->virtual_keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, size);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(string);
+    }
+    xkb_keymap_unref(keymap);
+    xkb_context_unref(context);
+
+    /* Move off the output corner so the wiggle below stays over a window. */
+    zwlr_virtual_pointer_v1_motion(bench->virtual_pointer, 0, wl_fixed_from_int(50), wl_fixed_from_int(50));
+    zwlr_virtual_pointer_v1_frame(bench->virtual_pointer);
+    return true;
+}
+
+static void bench_inject_input(struct bench *bench, double now)
+{
+    if (bench->virtual_pointer != NULL && bench->input_rate > 0 && now >= bench->next_motion)
+    {
+        bench->motion_dir = bench->motion_dir > 0 ? -1 : 1;
+        queue_push(&bench->motions, now);
+        zwlr_virtual_pointer_v1_motion(bench->virtual_pointer, (uint32_t)now,
+                wl_fixed_from_int(bench->motion_dir), 0);
+        zwlr_virtual_pointer_v1_frame(bench->virtual_pointer);
+        bench->next_motion += 1000.0 / bench->input_rate;
+        if (bench->next_motion < now)
+        {
+            bench->next_motion = now + 1000.0 / bench->input_rate;
+        }
+    }
+    if (bench->virtual_keyboard != NULL && bench->key_rate > 0 && now >= bench->next_key)
+    {
+        queue_push(&bench->keys, now);
+        zwp_virtual_keyboard_v1_key(bench->virtual_keyboard, (uint32_t)now, KEY_A, WL_KEYBOARD_KEY_STATE_PRESSED);
+        zwp_virtual_keyboard_v1_key(bench->virtual_keyboard, (uint32_t)now, KEY_A, WL_KEYBOARD_KEY_STATE_RELEASED);
+        bench->next_key += 1000.0 / bench->key_rate;
+        if (bench->next_key < now)
+        {
+            bench->next_key = now + 1000.0 / bench->key_rate;
+        }
+    }
+}
+
+static const struct
+{
+    const char *name;
+    enum bench_replay_type type;
+    int nargs;
+} replay_names[] = {
+        { "motion", REPLAY_MOTION, 2 },
+        { "motion_absolute", REPLAY_MOTION_ABSOLUTE, 2 },
+        { "button", REPLAY_BUTTON, 2 },
+        { "axis", REPLAY_AXIS, 3 },
+        { "key", REPLAY_KEY, 2 },
+        { "toplevel", REPLAY_TOPLEVEL, 1 },
+        { "unmap", REPLAY_UNMAP, 1 },
+        { "destroy", REPLAY_DESTROY, 1 },
+        { "fullscreen", REPLAY_FULLSCREEN, 2 },
+        { "commit", REPLAY_COMMIT, 8 },
+};
+
+/* Reads the whole trace up front and sizes bench->clients for the highest
+ * view id. Device and map lines are informational and skipped. */
+static bool replay_load(struct bench *bench)
+{
+    struct bench_replay *replay = &bench->replay;
+    FILE *f = fopen(replay->path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "failed to open %s: %s\n", replay->path, strerror(errno));
+        return false;
+    }
+
+    size_t cap = 0;
+    int max_id = 0, lineno = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    bool ok = true;
+    while (getline(&line, &line_cap, f) > 0)
+    {
+        lineno++;
+        double time;
+        char name[32];
+        int offset;
+        if (line[0] == '#' || sscanf(line, "%lf %31s %n", &time, name, &offset) != 2)
+        {
+            continue;
+        }
+        size_t i;
+        for (i = 0; i < sizeof(replay_names) / sizeof(replay_names[0]); i++)
+        {
+            if (strcmp(name, replay_names[i].name) == 0)
+            {
+                break;
+            }
+        }
+        if (i == sizeof(replay_names) / sizeof(replay_names[0]))
+        {
+            continue;
+        }
+
+        struct bench_replay_event event = { .time = time, .type = replay_names[i].type };
+        double *a = event.args;
+        int n = sscanf(line + offset, "%lf %lf %lf %lf %lf %lf %lf %lf",
+                &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &a[6], &a[7]);
+        if (n < replay_names[i].nargs)
+        {
+            fprintf(stderr, "%s:%d: malformed %s event\n", replay->path, lineno, name);
+            ok = false;
+            break;
+        }
+        if (event.type >= REPLAY_TOPLEVEL && a[0] > max_id)
+        {
+            max_id = (int)a[0];
+        }
+
+        if (replay->len == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            replay->events = realloc(replay->events, cap * sizeof(struct bench_replay_event));
+        }
+        replay->events[replay->len++] = event;
+    }
+    free(line);
+    fclose(f);
+    if (!ok)
+    {
+        return false;
+    }
+    if (replay->len == 0)
+    {
+        fprintf(stderr, "%s: no events to replay\n", replay->path);
+        return false;
+    }
+
+    bench->nclients = max_id + 1;
+    bench->duration = (replay->events[replay->len - 1].time + 500.0) / 1000.0;
+    return true;
+}
+
+static struct bench_client *replay_client(struct bench *bench, double id)
+{
+    if (id < 1 || id >= bench->nclients || bench->clients[(int)id].display == NULL)
+    {
+        return NULL;
+    }
+    return &bench->clients[(int)id];
+}
+
+static void replay_event(struct bench *bench, struct bench_replay_event *event, double now)
+{
+    double *a = event->args;
+    struct bench_client *client = event->type >= REPLAY_TOPLEVEL ? replay_client(bench, a[0]) : NULL;
+    uint32_t time = (uint32_t)now;
+    switch (event->type)
+    {
+        case REPLAY_MOTION:
+        case REPLAY_MOTION_ABSOLUTE:
+        case REPLAY_BUTTON:
+        case REPLAY_AXIS:
+            if (bench->virtual_pointer == NULL)
+            {
+                return;
+            }
+            if (event->type == REPLAY_MOTION)
+            {
+                queue_push(&bench->motions, now);
+                zwlr_virtual_pointer_v1_motion(bench->virtual_pointer, time,
+                        wl_fixed_from_double(a[0]), wl_fixed_from_double(a[1]));
+            }
+            else if (event->type == REPLAY_MOTION_ABSOLUTE)
+            {
+                queue_push(&bench->motions, now);
+                zwlr_virtual_pointer_v1_motion_absolute(bench->virtual_pointer, time,
+                        (uint32_t)(a[0] * 65535), (uint32_t)(a[1] * 65535), 65535, 65535);
+            }
+            else if (event->type == REPLAY_BUTTON)
+            {
+                zwlr_virtual_pointer_v1_button(bench->virtual_pointer, time, (uint32_t)a[0],
+                        a[1] != 0 ? WL_POINTER_BUTTON_STATE_PRESSED : WL_POINTER_BUTTON_STATE_RELEASED);
+            }
+            else if (a[2] != 0)
+            {
+                zwlr_virtual_pointer_v1_axis_discrete(bench->virtual_pointer, time, (uint32_t)a[0],
+                        wl_fixed_from_double(a[1]), (int32_t)a[2]);
+            }
+            else
+            {
+                zwlr_virtual_pointer_v1_axis(bench->virtual_pointer, time, (uint32_t)a[0], wl_fixed_from_double(a[1]));
+            }
+            zwlr_virtual_pointer_v1_frame(bench->virtual_pointer);
+            break;
+        case REPLAY_KEY:
+            if (bench->virtual_keyboard == NULL)
+            {
+                return;
+            }
+            if (a[1] != 0)
+            {
+                queue_push(&bench->keys, now);
+            }
+            zwp_virtual_keyboard_v1_key(bench->virtual_keyboard, time, (uint32_t)a[0],
+                    a[1] != 0 ? WL_KEYBOARD_KEY_STATE_PRESSED : WL_KEYBOARD_KEY_STATE_RELEASED);
+            break;
+        case REPLAY_TOPLEVEL:
+            if (a[0] < 1 || a[0] >= bench->nclients)
+            {
+                return;
+            }
+            client = &bench->clients[(int)a[0]];
+            client_disconnect(client);
+            if (!client_connect(client))
+            {
+                client_disconnect(client);
+                return;
+            }
+            client_create_toplevel(client);
+            break;
+        case REPLAY_UNMAP:
+            if (client == NULL)
+            {
+                return;
+            }
+            /* Unmapped xdg surfaces start over with an initial commit and
+             * wait for a new configure before the next buffer. */
+            if (client->frame_callback != NULL)
+            {
+                wl_callback_destroy(client->frame_callback);
+                client->frame_callback = NULL;
+            }
+            wl_surface_attach(client->surface, NULL, 0, 0);
+            wl_surface_commit(client->surface);
+            wl_surface_commit(client->surface);
+            client->configured = false;
+            client->width = client->height = 0;
+            break;
+        case REPLAY_DESTROY:
+            if (client != NULL)
+            {
+                client_disconnect(client);
+            }
+            break;
+        case REPLAY_FULLSCREEN:
+            if (client == NULL)
+            {
+                return;
+            }
+            if (a[1] != 0)
+            {
+                xdg_toplevel_set_fullscreen(client->xdg_toplevel, NULL);
+            }
+            else
+            {
+                xdg_toplevel_unset_fullscreen(client->xdg_toplevel);
+            }
+            break;
+        case REPLAY_COMMIT:
+            if (client == NULL || a[1] < 1 || a[2] < 1)
+            {
+                return;
+            }
+            client->width = (int)a[1];
+            client->height = (int)a[2];
+            if (client->configured)
+            {
+                /* Damage replays as its extents, clamped to the buffer. */
+                int x1 = a[3] < 0 ? 0 : (int)a[3];
+                int y1 = a[4] < 0 ? 0 : (int)a[4];
+                int x2 = a[5] > client->width ? client->width : (int)a[5];
+                int y2 = a[6] > client->height ? client->height : (int)a[6];
+                if (client->buffer_width != client->width || client->buffer_height != client->height)
+                {
+                    x1 = y1 = 0;
+                    x2 = client->width;
+                    y2 = client->height;
+                }
+                client_commit(client, now, x1, y1, x2 > x1 ? x2 - x1 : 0, y2 > y1 ? y2 - y1 : 0);
+            }
+            break;
+    }
+}
+
+static void replay_tick(struct bench *bench, double now)
+{
+    struct bench_replay *replay = &bench->replay;
+    while (replay->next < replay->len && bench->start + replay->events[replay->next].time <= now)
+    {
+        replay_event(bench, &replay->events[replay->next++], now);
+    }
+}
+
+static double bench_next_deadline(struct bench *bench)
+{
+    double deadline = bench->end;
+    if (bench->replay.next < bench->replay.len && bench->start + bench->replay.events[bench->replay.next].time < deadline)
+    {
+        deadline = bench->start + bench->replay.events[bench->replay.next].time;
+    }
+    if (bench->virtual_pointer != NULL && bench->input_rate > 0 && bench->next_motion < deadline)
+    {
+        deadline = bench->next_motion;
+    }
+    if (bench->virtual_keyboard != NULL && bench->key_rate > 0 && bench->next_key < deadline)
+    {
+        deadline = bench->next_key;
+    }
+    for (int i = 0; i < bench->nclients; i++)
+    {
+        struct bench_client *client = &bench->clients[i];
+        if (bench->commit_rate > 0 && client->configured && client->next_commit < deadline)
+        {
+            deadline = client->next_commit;
+        }
+    }
+    return deadline;
+}
+
+static void bench_tick(struct bench *bench, double now)
+{
+    if (bench->replay.path != NULL)
+    {
+        replay_tick(bench, now);
+        return;
+    }
+    bench_inject_input(bench, now);
+    for (int i = 0; i < bench->nclients; i++)
+    {
+        struct bench_client *client = &bench->clients[i];
+        if (!client->configured)
+        {
+            continue;
+        }
+        /* A zero rate means commit as soon as the previous frame is done, a
+         * negative one leaves the client idle after its first frame. */
+        if (bench->commit_rate < 0)
+        {
+            continue;
+        }
+        if (bench->commit_rate <= 0)
+        {
+            if (client->frame_callback == NULL)
+            {
+                client_commit(client, now, 0, 0, client->width, client->height);
+            }
+            continue;
+        }
+        if (now >= client->next_commit)
+        {
+            client_commit(client, now, 0, 0, client->width, client->height);
+            client->next_commit += 1000.0 / bench->commit_rate;
+            if (client->next_commit < now)
+            {
+                client->next_commit = now + 1000.0 / bench->commit_rate;
+            }
+        }
+    }
+}
+
+static bool bench_dispatch(struct bench *bench, int timeout)
+{
+    struct pollfd fds[bench->nclients];
+    for (int i = 0; i < bench->nclients; i++)
+    {
+        struct wl_display *display = bench->clients[i].display;
+        /* poll skips negative fds; replayed clients come and go. */
+        fds[i].fd = -1;
+        fds[i].revents = 0;
+        if (display == NULL)
+        {
+            continue;
+        }
+        while (wl_display_prepare_read(display) != 0)
+        {
+            wl_display_dispatch_pending(display);
+        }
+        wl_display_flush(display);
+        fds[i].fd = wl_display_get_fd(display);
+        fds[i].events = POLLIN;
+    }
+
+    int ret = poll(fds, bench->nclients, timeout);
+    for (int i = 0; i < bench->nclients; i++)
+    {
+        struct wl_display *display = bench->clients[i].display;
+        if (display == NULL)
+        {
+            continue;
+        }
+        if (ret > 0 && (fds[i].revents & POLLIN))
+        {
+            wl_display_read_events(display);
+        }
+        else
+        {
+            wl_display_cancel_read(display);
+        }
+        if (fds[i].revents & (POLLERR | POLLHUP) || wl_display_dispatch_pending(display) < 0)
+        {
+            return false;
+        }
+    }
+    return ret >= 0 || errno == EINTR;
+}
+
+static pid_t compositor_pid(struct wl_display *display)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(wl_display_get_fd(display), SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    {
+        return -1;
+    }
+    return cred.pid;
+}
+
+static void bench_report(struct bench *bench, struct proc_sample *before, struct proc_sample *after)
+{
+    FILE *f = stdout;
+    if (bench->output_path != NULL && (f = fopen(bench->output_path, "w")) == NULL)
+    {
+        fprintf(stderr, "failed to open %s: %s\n", bench->output_path, strerror(errno));
+        f = stdout;
+    }
+    double seconds = (bench->end - bench->start) / 1000.0;
+    fprintf(f, "{\n");
+    if (bench->replay.path != NULL)
+    {
+        fprintf(f, "  \"replay\": \"%s\",\n", bench->replay.path);
+        fprintf(f, "  \"replay_events\": %zu,\n", bench->replay.next);
+    }
+    fprintf(f, "  \"clients\": %d,\n", bench->nclients);
+    fprintf(f, "  \"width\": %d,\n", bench->width);
+    fprintf(f, "  \"height\": %d,\n", bench->height);
+    fprintf(f, "  \"fullscreen\": %s,\n", bench->fullscreen ? "true" : "false");
+    fprintf(f, "  \"commit_rate\": %.1f,\n", bench->commit_rate);
+    fprintf(f, "  \"input_rate\": %.1f,\n", bench->input_rate);
+    fprintf(f, "  \"key_rate\": %.1f,\n", bench->key_rate);
+    fprintf(f, "  \"duration_s\": %.3f,\n", seconds);
+    fprintf(f, "  \"commits\": %lu,\n", bench->commits);
+    fprintf(f, "  \"frames\": %lu,\n", bench->frames);
+    fprintf(f, "  \"throttled_commits\": %lu,\n", bench->throttled);
+    if (before != NULL && after != NULL)
+    {
+        double cpu = (after->utime - before->utime) + (after->stime - before->stime);
+        fprintf(f, "  \"compositor\": {\"pid\": %d, \"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, "
+                "\"cpu_percent\": %.2f, \"rss_kb\": %ld, \"rss_peak_kb\": %ld},\n",
+                bench->compositor_pid, after->utime - before->utime, after->stime - before->stime,
+                seconds > 0 ? cpu / seconds * 100.0 : 0, after->rss_kb, after->hwm_kb);
+    }
+    char *metrics = compositor_metrics();
+    if (metrics != NULL)
+    {
+        fprintf(f, "  \"scanout_candidates\": %lu,\n", metrics_counter(metrics, "miniwl_scanout_candidates_total"));
+        fprintf(f, "  \"scanouts\": %lu,\n", metrics_counter(metrics, "miniwl_scanout_total"));
+        free(metrics);
+    }
+    stats_print(f, "frame_interval_ms", &bench->frame_interval, false);
+    stats_print(f, "commit_to_frame_ms", &bench->commit_to_frame, false);
+    stats_print(f, "pointer_dispatch_ms", &bench->input_dispatch, false);
+    stats_print(f, "key_dispatch_ms", &bench->key_dispatch, false);
+    if (bench->capture.enabled)
+    {
+        fprintf(f, "  \"captures\": %lu,\n", bench->capture.frames);
+        fprintf(f, "  \"capture_failures\": %lu,\n", bench->capture.failures);
+        fprintf(f, "  \"capture_damage_rects\": %lu,\n", bench->capture.damage_rects);
+        stats_print(f, "capture_interval_ms", &bench->capture.interval, false);
+    }
+    stats_print(f, "input_to_frame_ms", &bench->input_to_present, true);
+    fprintf(f, "}\n");
+    if (f != stdout)
+    {
+        fclose(f);
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-c clients] [-s WIDTHxHEIGHT] [-r commit rate] [-i pointer rate]\n"
+           "          [-k key rate] [-d seconds] [-f] [-C] [-P trace] [-o output.json]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench bench = {
+            .nclients = 4,
+            .width = 640,
+            .height = 480,
+            .commit_rate = 60,
+            .input_rate = 1000,
+            .key_rate = 10,
+            .duration = 10,
+            .running = false,
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "c:s:r:i:k:d:fCP:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'c':
+                bench.nclients = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &bench.width, &bench.height) != 2)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                bench.commit_rate = atof(optarg);
+                break;
+            case 'i':
+                bench.input_rate = atof(optarg);
+                break;
+            case 'k':
+                bench.key_rate = atof(optarg);
+                break;
+            case 'd':
+                bench.duration = atof(optarg);
+                break;
+            case 'f':
+                bench.fullscreen = true;
+                break;
+            case 'C':
+                bench.capture.enabled = true;
+                break;
+            case 'P':
+                bench.replay.path = optarg;
+                break;
+            case 'o':
+                bench.output_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (bench.nclients < 1 || bench.width < 1 || bench.height < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* A replay brings its own clients, sizes and input. */
+    if (bench.replay.path != NULL)
+    {
+        if (!replay_load(&bench))
+        {
+            return 1;
+        }
+        bench.commit_rate = -1;
+        bench.input_rate = bench.key_rate = 0;
+    }
+
+    bench.clients = calloc(bench.nclients, sizeof(struct bench_client));
+    for (int i = 0; i < bench.nclients; i++)
+    {
+        bench.clients[i].bench = &bench;
+        bench.clients[i].width = bench.width;
+        bench.clients[i].height = bench.height;
+    }
+    for (int i = 0; i < (bench.replay.path != NULL ? 1 : bench.nclients); i++)
+    {
+        if (!client_connect(&bench.clients[i]))
+        {
+            return 1;
+        }
+        if (bench.replay.path == NULL)
+        {
+            client_create_toplevel(&bench.clients[i]);
+        }
+    }
+    bench.compositor_pid = compositor_pid(bench.clients[0].display);
+    bench_create_input(&bench);
+    if (bench.capture.enabled)
+    {
+        if (bench.clients[0].screencopy_mgr == NULL || bench.clients[0].output == NULL)
+        {
+            fprintf(stderr, "compositor does not support screencopy, capture disabled\n");
+            bench.capture.enabled = false;
+        }
+        else
+        {
+            capture_start(&bench);
+        }
+    }
+
+    /* Let every toplevel map before measuring. */
+    for (int i = 0; i < bench.nclients && bench.replay.path == NULL; i++)
+    {
+        while (!bench.clients[i].configured)
+        {
+            if (wl_display_dispatch(bench.clients[i].display) < 0)
+            {
+                return 1;
+            }
+        }
+        wl_display_roundtrip(bench.clients[i].display);
+    }
+
+    struct proc_sample before = {0}, after = {0};
+    bool have_proc = bench.compositor_pid > 0 && proc_sample(bench.compositor_pid, &before);
+
+    bench.running = true;
+    bench.start = now_ms();
+    bench.end = bench.start + bench.duration * 1000.0;
+    bench.next_motion = bench.next_key = bench.start;
+    for (int i = 0; i < bench.nclients; i++)
+    {
+        bench.clients[i].next_commit = bench.start;
+    }
+
+    double now;
+    while ((now = now_ms()) < bench.end)
+    {
+        bench_tick(&bench, now);
+        int timeout = (int)(bench_next_deadline(&bench) - now_ms());
+        if (!bench_dispatch(&bench, timeout < 0 ? 0 : timeout))
+        {
+            fprintf(stderr, "lost connection to the compositor\n");
+            break;
+        }
+    }
+    bench.end = now_ms();
+    bench.running = false;
+
+    have_proc = have_proc && proc_sample(bench.compositor_pid, &after);
+    bench_report(&bench, have_proc ? &before : NULL, have_proc ? &after : NULL);
+
+    for (int i = 0; i < bench.nclients; i++)
+    {
+        client_disconnect(&bench.clients[i]);
+    }
+    free(bench.clients);
+    free(bench.replay.events);
+    return 0;
+}
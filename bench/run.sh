@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs miniwl on the headless backend with the pixman renderer and drives it
+# with miniwl-bench. All knobs come from the environment so CI can sweep them;
+# the JSON report is written to $BENCH_OUT.
+set -e
+
+cd "$(dirname "$0")/.."
+
+: "${BENCH_CLIENTS:=4}"
+: "${BENCH_SIZE:=640x480}"
+: "${BENCH_RATE:=60}"
+: "${BENCH_INPUT_RATE:=1000}"
+: "${BENCH_KEY_RATE:=10}"
+: "${BENCH_DURATION:=10}"
+: "${BENCH_OUTPUTS:=1}"
+: "${BENCH_FULLSCREEN:=0}"
+: "${BENCH_CAPTURE:=0}"
+: "${BENCH_REPLAY:=}"
+: "${BENCH_OUT:=bench.json}"
+: "${BENCH_MINIWL_FLAGS:=}"
+
+export WLR_BACKENDS=headless
+export WLR_RENDERER=pixman
+export WLR_HEADLESS_OUTPUTS="$BENCH_OUTPUTS"
+export WLR_LIBINPUT_NO_DEVICES=1
+if [ -z "$XDG_RUNTIME_DIR" ]; then
+    XDG_RUNTIME_DIR=$(mktemp -d)
+    export XDG_RUNTIME_DIR
+fi
+
+BENCH_FLAGS=
+if [ "$BENCH_FULLSCREEN" != 0 ]; then
+    BENCH_FLAGS=-f
+fi
+if [ "$BENCH_CAPTURE" != 0 ]; then
+    BENCH_FLAGS="$BENCH_FLAGS -C"
+fi
+if [ -n "$BENCH_REPLAY" ]; then
+    BENCH_FLAGS="$BENCH_FLAGS -P $BENCH_REPLAY"
+fi
+
+rm -f "$BENCH_OUT"
+# -I offers the virtual pointer and keyboard the bench drives input with.
+# The startup command runs under a shell forked by miniwl, so $PPID there is
+# the compositor; stop it once the client has written its report.
+./miniwl -I $BENCH_MINIWL_FLAGS -s "./miniwl-bench -c $BENCH_CLIENTS -s $BENCH_SIZE -r $BENCH_RATE \
+    -i $BENCH_INPUT_RATE -k $BENCH_KEY_RATE -d $BENCH_DURATION $BENCH_FLAGS -o $BENCH_OUT; kill \$PPID" \
+    2> "$BENCH_OUT.log" || true
+
+if [ ! -s "$BENCH_OUT" ]; then
+    echo "bench: no report produced, see $BENCH_OUT.log" >&2
+    exit 1
+fi
+cat "$BENCH_OUT"
@@ -0,0 +1,404 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+#include "binlog.h"
+
+/* Open addressing on a hash of the format text; twice the format table so
+ * it never fills up. The pointer cache in front of it is the same size and
+ * stops taking entries once half full. */
+#define BINLOG_FORMAT_HASH (2 * MINIWL_BINLOG_FORMATS)
+
+static struct
+{
+    struct miniwl_binlog_header *header;
+    size_t size;
+    char *formats;
+    struct miniwl_binlog_record *records;
+    int verbosity;
+    pthread_mutex_t lock;
+    uint32_t hashes[BINLOG_FORMAT_HASH];
+    /* Format index + 1, 0 for a free slot. */
+    uint16_t values[BINLOG_FORMAT_HASH];
+    /* Format pointer to index, read without the lock. Entries are only
+     * added under it; a pointer keeps its slot, its index may change. */
+    const char *pointers[BINLOG_FORMAT_HASH];
+    uint16_t pointer_values[BINLOG_FORMAT_HASH];
+    size_t pointers_used;
+} binlog = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *importance_names[] = {
+        [WLR_SILENT] = "SILENT",
+        [WLR_ERROR] = "ERROR",
+        [WLR_INFO] = "INFO",
+        [WLR_DEBUG] = "DEBUG",
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool binlog_format_matches(uint16_t index, const char *fmt)
+{
+    return index < __atomic_load_n(&binlog.header->formats_used, __ATOMIC_ACQUIRE) &&
+            strcmp(binlog.formats + (size_t)index * MINIWL_BINLOG_FORMAT_SIZE, fmt) == 0;
+}
+
+static uint16_t binlog_format(const char *fmt)
+{
+    /* Almost every call comes from a string literal seen before, found by
+     * its pointer without taking the lock. The text is still compared,
+     * since libwayland's messages come through one static buffer in
+     * wlroots that is rewritten for every message. */
+    size_t pslot = ((uintptr_t)fmt >> 3) % BINLOG_FORMAT_HASH;
+    const char *key;
+    while ((key = __atomic_load_n(&binlog.pointers[pslot], __ATOMIC_ACQUIRE)) != NULL)
+    {
+        if (key == fmt)
+        {
+            uint16_t index = __atomic_load_n(&binlog.pointer_values[pslot], __ATOMIC_RELAXED);
+            if (binlog_format_matches(index, fmt))
+            {
+                return index;
+            }
+            break;
+        }
+        pslot = (pslot + 1) % BINLOG_FORMAT_HASH;
+    }
+
+    /* Otherwise intern by text, so each distinct format is copied into the
+     * file once. */
+    uint32_t hash = 2166136261u;
+    size_t len = 0;
+    for (const char *c = fmt; *c != '\0'; c++, len++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    if (len >= MINIWL_BINLOG_FORMAT_SIZE)
+    {
+        return MINIWL_BINLOG_FORMATTED;
+    }
+
+    size_t slot = hash % BINLOG_FORMAT_HASH;
+    uint16_t index = MINIWL_BINLOG_FORMATTED;
+    pthread_mutex_lock(&binlog.lock);
+    while (binlog.values[slot] != 0)
+    {
+        uint16_t candidate = binlog.values[slot] - 1;
+        if (binlog.hashes[slot] == hash &&
+                strcmp(binlog.formats + (size_t)candidate * MINIWL_BINLOG_FORMAT_SIZE, fmt) == 0)
+        {
+            index = candidate;
+            break;
+        }
+        slot = (slot + 1) % BINLOG_FORMAT_HASH;
+    }
+    if (index == MINIWL_BINLOG_FORMATTED && binlog.header->formats_used < MINIWL_BINLOG_FORMATS)
+    {
+        index = binlog.header->formats_used;
+        memcpy(binlog.formats + (size_t)index * MINIWL_BINLOG_FORMAT_SIZE, fmt, len + 1);
+        __atomic_store_n(&binlog.header->formats_used, index + 1, __ATOMIC_RELEASE);
+        binlog.hashes[slot] = hash;
+        binlog.values[slot] = index + 1;
+    }
+    if (index != MINIWL_BINLOG_FORMATTED)
+    {
+        /* Readers check the text behind whatever index they see, so the
+         * index of an existing pointer can be replaced in place. */
+        pslot = ((uintptr_t)fmt >> 3) % BINLOG_FORMAT_HASH;
+        while (binlog.pointers[pslot] != NULL && binlog.pointers[pslot] != fmt)
+        {
+            pslot = (pslot + 1) % BINLOG_FORMAT_HASH;
+        }
+        if (binlog.pointers[pslot] == fmt)
+        {
+            __atomic_store_n(&binlog.pointer_values[pslot], index, __ATOMIC_RELAXED);
+        }
+        else if (binlog.pointers_used < BINLOG_FORMAT_HASH / 2)
+        {
+            __atomic_store_n(&binlog.pointer_values[pslot], index, __ATOMIC_RELAXED);
+            __atomic_store_n(&binlog.pointers[pslot], fmt, __ATOMIC_RELEASE);
+            binlog.pointers_used++;
+        }
+    }
+    pthread_mutex_unlock(&binlog.lock);
+    return index;
+}
+
+static bool binlog_put(struct miniwl_binlog_record *record, uint64_t value)
+{
+    if (record->len + sizeof(value) > sizeof(record->payload))
+    {
+        record->flags |= MINIWL_BINLOG_TRUNCATED;
+        return false;
+    }
+    memcpy(record->payload + record->len, &value, sizeof(value));
+    record->len += sizeof(value);
+    return true;
+}
+
+static bool binlog_capture(struct miniwl_binlog_record *record, const char *fmt, va_list args)
+{
+    /* Walks the conversions the way printf would and copies out the raw
+     * arguments; anything unusual (%n, %m, wide strings) is formatted up
+     * front instead. */
+    for (const char *c = fmt; (c = strchr(c, '%')) != NULL;)
+    {
+        c++;
+        if (*c == '%')
+        {
+            c++;
+            continue;
+        }
+        c += strspn(c, "-+ #0'");
+        if (*c == '*')
+        {
+            c++;
+            if (!binlog_put(record, (uint64_t)(int64_t)va_arg(args, int)))
+            {
+                return true;
+            }
+        }
+        c += strspn(c, "0123456789");
+        /* Negative when there is none, as printf treats a negative '*'. */
+        long precision = -1;
+        if (*c == '.')
+        {
+            c++;
+            if (*c == '*')
+            {
+                c++;
+                int arg = va_arg(args, int);
+                precision = arg;
+                if (!binlog_put(record, (uint64_t)(int64_t)arg))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                precision = strtol(c, NULL, 10);
+                c += strspn(c, "0123456789");
+            }
+        }
+        int longs = 0;
+        bool size = false, long_double = false;
+        for (;; c++)
+        {
+            if (*c == 'l')
+            {
+                longs++;
+            }
+            else if (*c == 'z' || *c == 'j' || *c == 't')
+            {
+                size = true;
+            }
+            else if (*c == 'L')
+            {
+                long_double = true;
+            }
+            else if (*c != 'h')
+            {
+                break;
+            }
+        }
+
+        uint64_t value;
+        switch (*c)
+        {
+            case 'd':
+            case 'i':
+                value = size ? (uint64_t)va_arg(args, intmax_t) : longs == 2 ? (uint64_t)va_arg(args, long long) :
+                        longs == 1 ? (uint64_t)va_arg(args, long) : (uint64_t)va_arg(args, int);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                value = size ? (uint64_t)va_arg(args, uintmax_t) : longs == 2 ? va_arg(args, unsigned long long) :
+                        longs == 1 ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+                break;
+            case 'c':
+                if (longs > 0)
+                {
+                    return false;
+                }
+                value = (unsigned char)va_arg(args, int);
+                break;
+            case 'p':
+                value = (uintptr_t)va_arg(args, void *);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+            {
+                double d = long_double ? (double)va_arg(args, long double) : va_arg(args, double);
+                memcpy(&value, &d, sizeof(value));
+                break;
+            }
+            case 's':
+            {
+                if (longs > 0)
+                {
+                    return false;
+                }
+                const char *s = va_arg(args, const char *);
+                s = s != NULL ? s : "(null)";
+                size_t room = sizeof(record->payload) - record->len;
+                if (room == 0)
+                {
+                    record->flags |= MINIWL_BINLOG_TRUNCATED;
+                    return true;
+                }
+                /* With a precision the string need not be terminated, so
+                 * read no further than printf would. */
+                size_t limit = precision >= 0 && (size_t)precision < room - 1 ? (size_t)precision : room - 1;
+                size_t n = strnlen(s, limit);
+                memcpy(record->payload + record->len, s, n);
+                record->payload[record->len + n] = '\0';
+                record->len += n + 1;
+                if (n == room - 1 && (precision < 0 || (size_t)precision > n) && s[n] != '\0')
+                {
+                    record->flags |= MINIWL_BINLOG_TRUNCATED;
+                    return true;
+                }
+                c++;
+                continue;
+            }
+            default:
+                return false;
+        }
+        if (!binlog_put(record, value))
+        {
+            return true;
+        }
+        c++;
+    }
+    return true;
+}
+
+static void binlog_log(enum wlr_log_importance importance, const char *fmt, va_list args)
+{
+    if ((int)importance > binlog.verbosity)
+    {
+        return;
+    }
+    if (importance == WLR_ERROR || binlog.header == NULL)
+    {
+        va_list copy;
+        va_copy(copy, args);
+        fprintf(stderr, "[%s] ", importance_names[importance]);
+        vfprintf(stderr, fmt, copy);
+        fputc('\n', stderr);
+        va_end(copy);
+    }
+    if (binlog.header == NULL)
+    {
+        return;
+    }
+
+    /* Slots are claimed with one atomic add, so the render threads can log
+     * without a lock; a writer lapped by the whole ring before finishing
+     * just loses its record. */
+    uint64_t seq = __atomic_fetch_add(&binlog.header->head, 1, __ATOMIC_RELAXED);
+    struct miniwl_binlog_record *record = &binlog.records[seq % MINIWL_BINLOG_RECORDS];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    record->time_ns = clock_ns(CLOCK_MONOTONIC);
+    record->importance = importance;
+    record->flags = 0;
+    record->len = 0;
+    record->format = binlog_format(fmt);
+
+    va_list copy;
+    va_copy(copy, args);
+    bool captured = record->format != MINIWL_BINLOG_FORMATTED && binlog_capture(record, fmt, copy);
+    va_end(copy);
+    if (!captured)
+    {
+        record->format = MINIWL_BINLOG_FORMATTED;
+        record->flags = 0;
+        int n = vsnprintf((char *)record->payload, sizeof(record->payload), fmt, args);
+        record->len = n < 0 ? 0 : n < (int)sizeof(record->payload) ? (uint32_t)n + 1 : sizeof(record->payload);
+        if (n >= (int)sizeof(record->payload))
+        {
+            record->flags |= MINIWL_BINLOG_TRUNCATED;
+        }
+    }
+    __atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+}
+
+bool miniwl_binlog_open(const char *path, int verbosity)
+{
+    size_t size = sizeof(struct miniwl_binlog_header) + (size_t)MINIWL_BINLOG_FORMATS * MINIWL_BINLOG_FORMAT_SIZE +
+            (size_t)MINIWL_BINLOG_RECORDS * MINIWL_BINLOG_RECORD_SIZE;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to open binary log %s", path);
+        return false;
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to size binary log %s", path);
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to map binary log %s", path);
+        return false;
+    }
+
+    struct miniwl_binlog_header *header = data;
+    *header = (struct miniwl_binlog_header){
+            .record_size = MINIWL_BINLOG_RECORD_SIZE,
+            .record_count = MINIWL_BINLOG_RECORDS,
+            .format_size = MINIWL_BINLOG_FORMAT_SIZE,
+            .format_count = MINIWL_BINLOG_FORMATS,
+            .pid = getpid(),
+            .head = 1,
+            .realtime_ns = clock_ns(CLOCK_REALTIME),
+            .monotonic_ns = clock_ns(CLOCK_MONOTONIC),
+    };
+    memcpy(header->magic, MINIWL_BINLOG_MAGIC, sizeof(header->magic));
+    binlog.formats = (char *)(header + 1);
+    binlog.records = (struct miniwl_binlog_record *)(binlog.formats +
+            (size_t)MINIWL_BINLOG_FORMATS * MINIWL_BINLOG_FORMAT_SIZE);
+    binlog.size = size;
+    binlog.verbosity = verbosity;
+    binlog.header = header;
+    wlr_log_init(verbosity, binlog_log);
+    return true;
+}
+
+void miniwl_binlog_close(void)
+{
+    /* wlroots cannot go back to its own callback, so binlog_log keeps
+     * handling messages and sends them to stderr from here on. */
+    struct miniwl_binlog_header *header = binlog.header;
+    if (header == NULL)
+    {
+        return;
+    }
+    binlog.header = NULL;
+    munmap(header, binlog.size);
+}
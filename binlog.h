@@ -0,0 +1,68 @@
+#ifndef MINIWL_BINLOG_H
+#define MINIWL_BINLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Binary log ring for wlr_log. The file is mapped shared, so records reach
+ * the page cache without a write per line and survive a crash; formatting
+ * is left to miniwl-logdump. Layout:
+ *
+ *   header
+ *   format table: format_count slots of format_size bytes, each a format
+ *                 string, filled in the order formats are first logged
+ *   records:      record_count slots of record_size bytes, record seq lives
+ *                 in slot seq % record_count
+ *
+ * A record's payload holds its arguments in format order: integers and
+ * pointers as 8 bytes, floating point as a double, strings NUL terminated
+ * (cut short to fit). Sequence numbers start at 1; a record's seq is
+ * written last and is 0 while the record is being filled in, so a reader
+ * skips torn slots. */
+
+#define MINIWL_BINLOG_MAGIC "MWBLOG1"
+#define MINIWL_BINLOG_RECORD_SIZE 128
+#define MINIWL_BINLOG_RECORDS 32768
+#define MINIWL_BINLOG_FORMAT_SIZE 256
+#define MINIWL_BINLOG_FORMATS 2048
+/* format value of records whose text was formatted up front, because the
+ * format table was full or the format could not be captured. */
+#define MINIWL_BINLOG_FORMATTED 0xffff
+/* flags */
+#define MINIWL_BINLOG_TRUNCATED 1
+
+struct miniwl_binlog_header
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t format_size;
+    uint32_t format_count;
+    uint32_t formats_used;
+    uint32_t pid;
+    /* Next sequence number; records head - record_count .. head - 1 are in
+     * the ring. */
+    uint64_t head;
+    /* CLOCK_REALTIME and CLOCK_MONOTONIC taken together at open, so the
+     * monotonic record times can be shown as wall clock. */
+    uint64_t realtime_ns;
+    uint64_t monotonic_ns;
+};
+
+struct miniwl_binlog_record
+{
+    uint64_t seq;
+    uint64_t time_ns;
+    uint16_t format;
+    uint8_t importance;
+    uint8_t flags;
+    uint32_t len;
+    uint8_t payload[MINIWL_BINLOG_RECORD_SIZE - 24];
+};
+
+/* Replaces the wlr_log callback: messages up to verbosity go to the ring at
+ * path, errors are also written to stderr. */
+bool miniwl_binlog_open(const char *path, int verbosity);
+void miniwl_binlog_close(void);
+
+#endif
@@ -0,0 +1,530 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "composite.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define ALPHA_MASK 0xff000000u
+
+static inline uint32_t div255(uint32_t x)
+{
+    return (x + 128 + ((x + 128) >> 8)) >> 8;
+}
+
+static inline uint32_t over_pixel(uint32_t s, uint32_t d)
+{
+    uint32_t ia = 255 - (s >> 24);
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        uint32_t c = ((s >> shift) & 0xff) + div255(((d >> shift) & 0xff) * ia);
+        out |= (c > 255 ? 255 : c) << shift;
+    }
+    return out;
+}
+
+static bool scalar_supported(void)
+{
+    return true;
+}
+
+static void fill_scalar(uint32_t *dst, uint32_t color, int width)
+{
+    for (int i = 0; i < width; i++)
+    {
+        dst[i] = color;
+    }
+}
+
+static void copy_scalar(uint32_t *dst, const uint32_t *src, int width)
+{
+    for (int i = 0; i < width; i++)
+    {
+        dst[i] = src[i] | ALPHA_MASK;
+    }
+}
+
+static void over_scalar(uint32_t *dst, const uint32_t *src, int width)
+{
+    for (int i = 0; i < width; i++)
+    {
+        uint32_t s = src[i];
+        if (s >= ALPHA_MASK)
+        {
+            dst[i] = s;
+        }
+        else if (s != 0)
+        {
+            dst[i] = over_pixel(s, dst[i]);
+        }
+    }
+}
+
+static void scale_scalar(uint32_t *dst, const uint32_t *src, int phase, int width, int factor)
+{
+    const uint32_t *s = src + phase / factor;
+    int run = factor - phase % factor;
+    int i = 0;
+    while (i < width)
+    {
+        uint32_t pixel = *s++;
+        int end = i + run < width ? i + run : width;
+        for (; i < end; i++)
+        {
+            dst[i] = pixel;
+        }
+        run = factor;
+    }
+}
+
+static const struct miniwl_composite_ops scalar_ops = {
+        .name = "scalar",
+        .supported = scalar_supported,
+        .fill = fill_scalar,
+        .copy = copy_scalar,
+        .over = over_scalar,
+        .scale = scale_scalar,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The x86 kernels are built with per-function target attributes so the rest
+ * of the binary keeps the baseline ISA; they only run after the CPU check. */
+
+static bool sse4_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i div255_sse4(__m128i x)
+{
+    __m128i t = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i over4_sse4(__m128i s, __m128i d)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i ia = _mm_xor_si128(s, _mm_set1_epi32(-1));
+    __m128i ia_lo = _mm_unpacklo_epi8(ia, zero);
+    __m128i ia_hi = _mm_unpackhi_epi8(ia, zero);
+    ia_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ia_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    ia_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ia_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i d_lo = div255_sse4(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia_lo));
+    __m128i d_hi = div255_sse4(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia_hi));
+    return _mm_adds_epu8(s, _mm_packus_epi16(d_lo, d_hi));
+}
+
+__attribute__((target("sse4.1")))
+static void fill_sse4(uint32_t *dst, uint32_t color, int width)
+{
+    __m128i c = _mm_set1_epi32((int)color);
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        _mm_storeu_si128((__m128i *)(dst + i), c);
+    }
+    fill_scalar(dst + i, color, width - i);
+}
+
+__attribute__((target("sse4.1")))
+static void copy_sse4(uint32_t *dst, const uint32_t *src, int width)
+{
+    __m128i alpha = _mm_set1_epi32((int)ALPHA_MASK);
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(s, alpha));
+    }
+    copy_scalar(dst + i, src + i, width - i);
+}
+
+__attribute__((target("sse4.1")))
+static void over_sse4(uint32_t *dst, const uint32_t *src, int width)
+{
+    __m128i alpha = _mm_set1_epi32((int)ALPHA_MASK);
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_testz_si128(s, s))
+        {
+            continue;
+        }
+        if (_mm_testc_si128(s, alpha))
+        {
+            _mm_storeu_si128((__m128i *)(dst + i), s);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), over4_sse4(s, d));
+    }
+    over_scalar(dst + i, src + i, width - i);
+}
+
+__attribute__((target("sse4.1")))
+static void scale_sse4(uint32_t *dst, const uint32_t *src, int phase, int width, int factor)
+{
+    if (factor != 2)
+    {
+        scale_scalar(dst, src, phase, width, factor);
+        return;
+    }
+    if (phase % 2 != 0 && width > 0)
+    {
+        *dst++ = src[phase / 2];
+        phase++;
+        width--;
+    }
+    src += phase / 2;
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i / 2));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi32(s, s));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi32(s, s));
+    }
+    scale_scalar(dst + i, src + i / 2, 0, width - i, 2);
+}
+
+static const struct miniwl_composite_ops sse4_ops = {
+        .name = "sse4.1",
+        .supported = sse4_supported,
+        .fill = fill_sse4,
+        .copy = copy_sse4,
+        .over = over_sse4,
+        .scale = scale_sse4,
+};
+
+static bool avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255_avx2(__m256i x)
+{
+    __m256i t = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+/* Unpack and pack both work within 128-bit lanes, so the pixel order comes
+ * back out unchanged. */
+__attribute__((target("avx2")))
+static inline __m256i over8_avx2(__m256i s, __m256i d)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ia = _mm256_xor_si256(s, _mm256_set1_epi32(-1));
+    __m256i ia_lo = _mm256_unpacklo_epi8(ia, zero);
+    __m256i ia_hi = _mm256_unpackhi_epi8(ia, zero);
+    ia_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ia_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    ia_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ia_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i d_lo = div255_avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia_lo));
+    __m256i d_hi = div255_avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia_hi));
+    return _mm256_adds_epu8(s, _mm256_packus_epi16(d_lo, d_hi));
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint32_t *dst, uint32_t color, int width)
+{
+    __m256i c = _mm256_set1_epi32((int)color);
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        _mm256_storeu_si256((__m256i *)(dst + i), c);
+    }
+    fill_scalar(dst + i, color, width - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(uint32_t *dst, const uint32_t *src, int width)
+{
+    __m256i alpha = _mm256_set1_epi32((int)ALPHA_MASK);
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(s, alpha));
+    }
+    copy_scalar(dst + i, src + i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void over_avx2(uint32_t *dst, const uint32_t *src, int width)
+{
+    __m256i alpha = _mm256_set1_epi32((int)ALPHA_MASK);
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        if (_mm256_testz_si256(s, s))
+        {
+            continue;
+        }
+        if (_mm256_testc_si256(s, alpha))
+        {
+            _mm256_storeu_si256((__m256i *)(dst + i), s);
+            continue;
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), over8_avx2(s, d));
+    }
+    over_scalar(dst + i, src + i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void scale_avx2(uint32_t *dst, const uint32_t *src, int phase, int width, int factor)
+{
+    if (factor != 2)
+    {
+        scale_scalar(dst, src, phase, width, factor);
+        return;
+    }
+    if (phase % 2 != 0 && width > 0)
+    {
+        *dst++ = src[phase / 2];
+        phase++;
+        width--;
+    }
+    src += phase / 2;
+    __m256i index = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i / 2));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(s), index));
+    }
+    scale_scalar(dst + i, src + i / 2, 0, width - i, 2);
+}
+
+static const struct miniwl_composite_ops avx2_ops = {
+        .name = "avx2",
+        .supported = avx2_supported,
+        .fill = fill_avx2,
+        .copy = copy_avx2,
+        .over = over_avx2,
+        .scale = scale_avx2,
+};
+
+#elif defined(__aarch64__)
+
+/* NEON is mandatory on AArch64, so there is nothing to check at runtime. */
+
+static void fill_neon(uint32_t *dst, uint32_t color, int width)
+{
+    uint32x4_t c = vdupq_n_u32(color);
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        vst1q_u32(dst + i, c);
+    }
+    fill_scalar(dst + i, color, width - i);
+}
+
+static void copy_neon(uint32_t *dst, const uint32_t *src, int width)
+{
+    uint32x4_t alpha = vdupq_n_u32(ALPHA_MASK);
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        vst1q_u32(dst + i, vorrq_u32(vld1q_u32(src + i), alpha));
+    }
+    copy_scalar(dst + i, src + i, width - i);
+}
+
+static void over_neon(uint32_t *dst, const uint32_t *src, int width)
+{
+    static const uint8_t alpha_index[16] = { 3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15 };
+    uint8x16_t index = vld1q_u8(alpha_index);
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        uint8x16_t s = vld1q_u8((const uint8_t *)(src + i));
+        if (vmaxvq_u8(s) == 0)
+        {
+            continue;
+        }
+        uint8x16_t ia = vmvnq_u8(vqtbl1q_u8(s, index));
+        uint8x16_t d = vld1q_u8((const uint8_t *)(dst + i));
+        uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(ia));
+        uint16x8_t hi = vmull_high_u8(d, ia);
+        /* (x + 128 + ((x + 128) >> 8)) >> 8, as in div255. */
+        uint8x16_t r = vcombine_u8(vrshrn_n_u16(vrsraq_n_u16(lo, lo, 8), 8), vrshrn_n_u16(vrsraq_n_u16(hi, hi, 8), 8));
+        vst1q_u8((uint8_t *)(dst + i), vqaddq_u8(s, r));
+    }
+    over_scalar(dst + i, src + i, width - i);
+}
+
+static void scale_neon(uint32_t *dst, const uint32_t *src, int phase, int width, int factor)
+{
+    if (factor != 2)
+    {
+        scale_scalar(dst, src, phase, width, factor);
+        return;
+    }
+    if (phase % 2 != 0 && width > 0)
+    {
+        *dst++ = src[phase / 2];
+        phase++;
+        width--;
+    }
+    src += phase / 2;
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        uint32x4_t s = vld1q_u32(src + i / 2);
+        uint32x4x2_t z = vzipq_u32(s, s);
+        vst1q_u32(dst + i, z.val[0]);
+        vst1q_u32(dst + i + 4, z.val[1]);
+    }
+    scale_scalar(dst + i, src + i / 2, 0, width - i, 2);
+}
+
+static const struct miniwl_composite_ops neon_ops = {
+        .name = "neon",
+        .supported = scalar_supported,
+        .fill = fill_neon,
+        .copy = copy_neon,
+        .over = over_neon,
+        .scale = scale_neon,
+};
+
+#endif
+
+/* Best first. */
+static const struct miniwl_composite_ops *const all_ops[] = {
+#if defined(__x86_64__) || defined(__i386__)
+        &avx2_ops,
+        &sse4_ops,
+#elif defined(__aarch64__)
+        &neon_ops,
+#endif
+        &scalar_ops,
+};
+
+const struct miniwl_composite_ops *const *miniwl_composite_ops_list(size_t *count)
+{
+    *count = sizeof(all_ops) / sizeof(all_ops[0]);
+    return all_ops;
+}
+
+const struct miniwl_composite_ops *miniwl_composite_get(void)
+{
+    /* MINIWL_COMPOSITE names a table to use instead, for comparisons. */
+    const char *name = getenv("MINIWL_COMPOSITE");
+    size_t count;
+    const struct miniwl_composite_ops *const *list = miniwl_composite_ops_list(&count);
+    for (size_t i = 0; name != NULL && i < count; i++)
+    {
+        if (strcmp(list[i]->name, name) == 0 && list[i]->supported())
+        {
+            return list[i];
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (list[i]->supported())
+        {
+            return list[i];
+        }
+    }
+    return &scalar_ops;
+}
+
+static bool format_has_kernel(pixman_format_code_t format)
+{
+    return format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8;
+}
+
+void miniwl_composite_fill(const struct miniwl_composite_ops *ops, pixman_image_t *dst,
+        const pixman_box32_t *box, uint32_t color)
+{
+    int x1 = box->x1 > 0 ? box->x1 : 0;
+    int y1 = box->y1 > 0 ? box->y1 : 0;
+    int x2 = box->x2 < pixman_image_get_width(dst) ? box->x2 : pixman_image_get_width(dst);
+    int y2 = box->y2 < pixman_image_get_height(dst) ? box->y2 : pixman_image_get_height(dst);
+    uint32_t *data = pixman_image_get_data(dst);
+    int stride = pixman_image_get_stride(dst) / 4;
+    for (int y = y1; y < y2 && x1 < x2; y++)
+    {
+        ops->fill(data + y * stride + x1, color, x2 - x1);
+    }
+}
+
+bool miniwl_composite_blit(const struct miniwl_composite_ops *ops, pixman_image_t *dst, pixman_image_t *src,
+        int x, int y, int factor, const pixman_box32_t *box)
+{
+    pixman_format_code_t src_format = pixman_image_get_format(src);
+    if (!format_has_kernel(src_format) || !format_has_kernel(pixman_image_get_format(dst)) || factor < 1)
+    {
+        return false;
+    }
+
+    int x1 = box->x1 > x ? box->x1 : x;
+    int y1 = box->y1 > y ? box->y1 : y;
+    int x2 = x + pixman_image_get_width(src) * factor;
+    int y2 = y + pixman_image_get_height(src) * factor;
+    x1 = x1 > 0 ? x1 : 0;
+    y1 = y1 > 0 ? y1 : 0;
+    x2 = x2 < box->x2 ? x2 : box->x2;
+    y2 = y2 < box->y2 ? y2 : box->y2;
+    x2 = x2 < pixman_image_get_width(dst) ? x2 : pixman_image_get_width(dst);
+    y2 = y2 < pixman_image_get_height(dst) ? y2 : pixman_image_get_height(dst);
+    if (x1 >= x2 || y1 >= y2)
+    {
+        return true;
+    }
+
+    int width = x2 - x1;
+    uint32_t *row = NULL;
+    if (factor > 1)
+    {
+        row = malloc(width * sizeof(uint32_t));
+        if (row == NULL)
+        {
+            return false;
+        }
+    }
+
+    bool opaque = src_format == PIXMAN_x8r8g8b8;
+    const uint32_t *src_data = pixman_image_get_data(src);
+    int src_stride = pixman_image_get_stride(src) / 4;
+    uint32_t *dst_data = pixman_image_get_data(dst);
+    int dst_stride = pixman_image_get_stride(dst) / 4;
+    int scaled = -1;
+    for (int dy = y1; dy < y2; dy++)
+    {
+        int sy = (dy - y) / factor;
+        const uint32_t *s = src_data + sy * src_stride + (x1 - x);
+        if (row != NULL)
+        {
+            /* Each source row covers factor output rows; scale it once. */
+            if (sy != scaled)
+            {
+                ops->scale(row, src_data + sy * src_stride, x1 - x, width, factor);
+                scaled = sy;
+            }
+            s = row;
+        }
+        uint32_t *d = dst_data + dy * dst_stride + x1;
+        if (opaque)
+        {
+            ops->copy(d, s, width);
+        }
+        else
+        {
+            ops->over(d, s, width);
+        }
+    }
+    free(row);
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef MINIWL_COMPOSITE_H
+#define MINIWL_COMPOSITE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Row kernels for the CPU render path, on 32-bit pixels with the alpha (or
+ * padding) byte on top, i.e. pixman a8r8g8b8/x8r8g8b8. Sources for over are
+ * premultiplied. One table per instruction set; miniwl_composite_get picks
+ * the best one the CPU supports. */
+
+struct miniwl_composite_ops
+{
+    const char *name;
+    bool (*supported)(void);
+    void (*fill)(uint32_t *dst, uint32_t color, int width);
+    /* Copies an opaque row, forcing the alpha byte to 0xff. */
+    void (*copy)(uint32_t *dst, const uint32_t *src, int width);
+    void (*over)(uint32_t *dst, const uint32_t *src, int width);
+    /* dst[i] = src[(phase + i) / factor], a nearest-neighbour upscale. */
+    void (*scale)(uint32_t *dst, const uint32_t *src, int phase, int width, int factor);
+};
+
+const struct miniwl_composite_ops *miniwl_composite_get(void);
+/* All tables built into this binary, including unsupported ones. */
+const struct miniwl_composite_ops *const *miniwl_composite_ops_list(size_t *count);
+
+void miniwl_composite_fill(const struct miniwl_composite_ops *ops, pixman_image_t *dst,
+        const pixman_box32_t *box, uint32_t color);
+/* Draws src at (x, y) in dst scaled up by an integer factor, clipped to box.
+ * Returns false, without drawing, if either format has no kernel. */
+bool miniwl_composite_blit(const struct miniwl_composite_ops *ops, pixman_image_t *dst, pixman_image_t *src,
+        int x, int y, int factor, const pixman_box32_t *box);
+
+#endif
@@ -1,28 +1,67 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
+#include <drm_fourcc.h>
+#include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pixman.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
+#include <wlr/render/allocator.h>
+#include <wlr/render/drm_format_set.h>
 #include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_compositor.h>
+#include <wlr/types/wlr_damage_ring.h>
 #include <wlr/types/wlr_data_device.h>
+#include <wlr/types/wlr_export_dmabuf_v1.h>
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_keyboard.h>
-#include <wlr/types/wlr_matrix.h>
+#include <wlr/types/wlr_keyboard_group.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_pointer_constraints_v1.h>
+#include <wlr/types/wlr_presentation_time.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/types/wlr_screencopy_v1.h>
 #include <wlr/types/wlr_seat.h>
+#include <wlr/types/wlr_single_pixel_buffer_v1.h>
+#include <wlr/types/wlr_subcompositor.h>
+#include <wlr/types/wlr_virtual_keyboard_v1.h>
+#include <wlr/types/wlr_virtual_pointer_v1.h>
 #include <wlr/types/wlr_xcursor_manager.h>
+#include <wlr/types/wlr_viewporter.h>
 #include <wlr/types/wlr_xdg_shell.h>
+#include <wlr/util/box.h>
 #include <wlr/util/log.h>
+#include <wlr/util/region.h>
+#include <wlr/version.h>
 #include <xkbcommon/xkbcommon.h>
 #include <wlr/types/wlr_pointer.h>
+#include "binlog.h"
+#include "render.h"
+#include "stats.h"
+#include "trace.h"
+
+/* -P hands outputs to the client display by rewriting wlr_output->display,
+ * which only matches the output code of wlroots 0.16. */
+#define MINIWL_INPUT_PRIORITY (WLR_VERSION_MAJOR == 0 && WLR_VERSION_MINOR == 16)
+
+#define MINIWL_GRID_CELL_SIZE 256
+#define MINIWL_GRID_BUCKETS 1024
+#define MINIWL_WORKSPACES 9
+#define MINIWL_CACHE_SETTLE_NS 100000000
+#define MINIWL_RENDER_BUFFERS 3
+#define MINIWL_RENDER_HISTORY 16
 
 enum miniwl_cursor_mode
 {
@@ -31,30 +70,74 @@ enum miniwl_cursor_mode
     MINIWL_CURSOR_RESIZE,
 };
 
+struct miniwl_workspace
+{
+    struct miniwl_server *server;
+    /* Disabled while the workspace is hidden, so the scene neither renders
+     * its views nor sends them frame callbacks. */
+    struct wlr_scene_tree *tree;
+    struct wl_list views;
+    int64_t stack_top, stack_bottom;
+
+    /* Uniform grid over mapped view bounds, hashed by cell. Views with open
+     * popups can reach outside their bounds and are always hit tested. */
+    struct wl_array grid[MINIWL_GRID_BUCKETS];
+    struct wl_list grid_overflow;
+};
+
 struct miniwl_server
 {
     /* data */
     struct wl_display *wl_display;
+    /* Same as wl_display unless -P gave the backend a display of its own,
+     * whose loop is drained before any client is dispatched. */
+    struct wl_display *backend_display;
     struct wlr_backend *backend;
     struct wlr_renderer *renderer;
+    struct wlr_allocator *allocator;
+    struct wlr_scene *scene;
 
     struct wlr_xdg_shell *xdg_shell;
     struct wl_listener new_xdg_surface;
-    struct wl_list views;
+    struct miniwl_workspace workspaces[MINIWL_WORKSPACES];
+    struct miniwl_workspace *workspace;
+    uint32_t next_view_id;
+    bool occlusion_dirty;
 
     struct wlr_cursor *cursor;
     struct wlr_xcursor_manager *cursor_mgr;
+    /* Name of the xcursor image last set, NULL after a client surface or
+     * none was set instead. Callers pass string literals. */
+    const char *cursor_image;
     struct wl_listener cursor_motion;
     struct wl_listener cursor_motion_absolute;
     struct wl_listener cursor_button;
     struct wl_listener cursor_axis;
     struct wl_listener cursor_frame;
+    bool coalesce_motion;
+    bool motion_pending;
+    uint32_t motion_time;
 
     struct wlr_seat *seat;
     struct wl_listener new_input;
+    struct wlr_virtual_pointer_manager_v1 *virtual_pointer_mgr;
+    struct wl_listener new_virtual_pointer;
+    struct wlr_virtual_keyboard_manager_v1 *virtual_keyboard_mgr;
+    struct wl_listener new_virtual_keyboard;
     struct wl_listener request_cursor;
     struct wl_listener request_set_selection;
+    struct wlr_relative_pointer_manager_v1 *relative_pointer_mgr;
+    struct wlr_pointer_constraints_v1 *pointer_constraints;
+    struct wl_listener new_pointer_constraint;
+    struct wlr_pointer_constraint_v1 *active_constraint;
+    /* Layout position of the constrained surface when its constraint was
+     * activated, for the cursor position hint on unlock. */
+    double constraint_x, constraint_y;
     struct wl_list keyboard;
+    struct xkb_context *xkb_context;
+    struct wl_list keymaps;
+    struct wlr_keyboard_group *keyboard_group;
+    struct miniwl_keyboard *group_keyboard;
     enum miniwl_cursor_mode cursor_mode;
     struct miniwl_view *grabbed_view;
     double grab_x, grab_y;
@@ -64,20 +147,108 @@ struct miniwl_server
     struct wlr_output_layout *output_layout;
     struct wl_list outputs;
     struct wl_listener new_output;
+    struct wlr_presentation *presentation;
+
+    struct miniwl_stats stats;
+    struct miniwl_render_pool render_pool;
+    bool late_latch;
+    uint64_t latch_margin_ns;
+    /* Minimum time between frame callbacks for views without keyboard
+     * focus, UINT64_MAX to stop them entirely; 0 means no budget. */
+    uint64_t unfocused_frame_ns;
+    int flatten_surfaces;
+    uint64_t snapshot_seq;
+    struct miniwl_trace trace;
 };
 
 struct miniwl_view
 {
     struct wl_list link;
     struct miniwl_server *server;
+    struct miniwl_workspace *workspace;
     struct wlr_xdg_surface *xdg_surface;
+    struct wlr_scene_tree *scene_tree;
     struct wl_listener map;
     struct wl_listener unmap;
     struct wl_listener destroy;
+    struct wl_listener commit;
     struct wl_listener request_move;
     struct wl_listener request_resize;
+    struct wl_listener request_fullscreen;
+    uint32_t id;
     bool mapped;
     int x, y;
+    bool fullscreen;
+    struct wlr_box saved_box;
+
+    /* At most one resize configure is in flight; newer sizes wait in
+     * resize_box until the client acks and commits it. */
+    uint32_t resize_serial;
+    uint32_t resize_edges;
+    uint64_t resize_sent_ns;
+    struct wlr_box resize_inflight;
+    struct wlr_box resize_box;
+    bool resize_pending;
+    int64_t stack;
+    struct wlr_box grid_box;
+    struct wl_list overflow_link;
+    int popup_count;
+    bool occluded;
+    /* Last seen opaque region of the toplevel surface; commits only redo
+     * occlusion when it or the bounds change. */
+    pixman_region32_t opaque;
+
+    struct miniwl_view_stats stats;
+    uint64_t frame_done_ns;
+    uint64_t frame_pass_ns;
+    bool frame_pass_sent;
+
+    /* The toplevel's surface tree flattened into one image for the render
+     * pool. Any commit or destroy within the tree drops it; it is rebuilt
+     * once the tree has been quiet for MINIWL_CACHE_SETTLE_NS. */
+    pixman_image_t *cache;
+    struct wl_array cache_surfaces;
+    uint64_t cache_dirty_ns;
+    uint64_t cache_snapshot;
+};
+
+struct miniwl_cache_surface
+{
+    struct miniwl_view *view;
+    struct wlr_surface *surface;
+    int x, y;
+    struct wl_listener commit;
+    struct wl_listener destroy;
+};
+
+struct cache_build
+{
+    struct miniwl_view *view;
+    pixman_image_t *image;
+    pixman_box32_t bounds;
+    int count;
+    bool ok;
+};
+
+struct miniwl_popup
+{
+    struct miniwl_view *view;
+    struct wl_listener destroy;
+};
+
+struct miniwl_grid_entry
+{
+    int cx, cy;
+    struct miniwl_view *view;
+};
+
+struct miniwl_output_buffer
+{
+    struct miniwl_output *output;
+    struct wlr_buffer *buffer;
+    struct wl_listener release;
+    bool busy;
+    uint64_t seq;
 };
 
 struct miniwl_output
@@ -86,6 +257,95 @@ struct miniwl_output
     struct miniwl_server *server;
     struct wlr_output *wlr_output;
     struct wl_listener frame;
+    struct wl_listener precommit;
+    struct wl_listener present;
+    struct wl_listener destroy;
+
+    struct miniwl_output_stats stats;
+    struct miniwl_frame_sample *frame_sample;
+    /* The last frame committed and the commit_seq its present event will
+     * carry. Backends may present from inside the commit (headless does),
+     * before the frame's stats are closed. */
+    struct miniwl_frame_sample *present_sample;
+    uint32_t present_seq;
+    struct wlr_buffer *scanout_buffer;
+
+    /* Parallel rendering: our own buffers, their age bookkeeping and the
+     * frame currently being composited by the render pool. Our frames do
+     * not age the scene's swapchain, nor its frames ours, so the buffers
+     * have a damage ring of their own and whichever side did not draw the
+     * last frame repaints in full. */
+    struct miniwl_output_buffer buffers[MINIWL_RENDER_BUFFERS];
+    struct wlr_damage_ring damage_ring;
+    uint64_t render_seq;
+    bool render_async_last;
+    struct miniwl_output_job *job;
+    bool frame_pending;
+    bool render_async_failed;
+
+    /* Late latching: a frame event arms render_timer so that rendering
+     * starts as close to the next vblank as recent render times allow. */
+    struct wl_event_source *render_timer;
+    bool render_scheduled;
+    uint64_t frame_ns;
+    uint64_t last_present_ns;
+    uint64_t refresh_ns;
+    uint64_t deadline_ns;
+    uint64_t render_history[MINIWL_RENDER_HISTORY];
+    uint64_t render_history_len;
+
+    /* Wakes the output when a throttled view's frame budget runs out. */
+    struct wl_event_source *budget_timer;
+};
+
+struct miniwl_output_job
+{
+    struct miniwl_render_job job;
+    struct miniwl_output *output;
+    struct miniwl_output_buffer *target;
+    struct miniwl_frame_sample *sample;
+};
+
+struct snapshot_data
+{
+    struct wlr_scene_output *scene_output;
+    struct miniwl_output_job *job;
+    uint64_t seq;
+    uint64_t now_ns;
+    bool ok;
+};
+
+struct frame_done_data
+{
+    struct wlr_scene_output *scene_output;
+    struct timespec *when;
+    uint64_t now_ns;
+    uint64_t wakeup_ns;
+    uint32_t count;
+    uint32_t deferred;
+};
+
+struct scanout_data
+{
+    struct wlr_scene_output *scene_output;
+    struct wlr_scene_buffer *buffer;
+    int count;
+};
+
+/* One compiled keymap per RMLVO set, shared by every keyboard using it. */
+struct miniwl_keymap
+{
+    struct wl_list link;
+    char *rules, *model, *layout, *variant, *options;
+    struct xkb_keymap *keymap;
+};
+
+struct miniwl_pointer_constraint
+{
+    struct miniwl_server *server;
+    struct wlr_pointer_constraint_v1 *constraint;
+    struct wl_listener set_region;
+    struct wl_listener destroy;
 };
 
 struct miniwl_keyboard
@@ -95,32 +355,90 @@ struct miniwl_keyboard
     struct wlr_input_device *device;
     struct wl_listener modifiers;
     struct wl_listener key;
+    struct wl_listener destroy;
 };
 
-struct render_data
-{
-    struct wlr_output *output;
-    struct wlr_renderer *renderer;
-    struct miniwl_view *view;
-    struct timespec *when;
-};
-
-static bool view_at(struct miniwl_view *view, double lx, double ly, struct wlr_surface **surface, double *sx, double *sy);
 static void output_frame(struct wl_listener *listener, void *data);
+static int output_render_timer(void *data);
+static int output_budget_timer(void *data);
+static uint64_t output_predict_render(struct miniwl_output *output);
+static int output_latch_delay(struct miniwl_output *output);
+static void output_render(struct miniwl_output *output);
+static void output_precommit(struct wl_listener *listener, void *data);
+static void output_present(struct wl_listener *listener, void *data);
+static void output_destroy(struct wl_listener *listener, void *data);
+static void output_frame_done(struct miniwl_output *output, struct wlr_scene_output *scene_output, struct miniwl_frame_sample *sample);
+static pixman_format_code_t pixman_format_from_drm(uint32_t format);
+static void output_buffer_handle_release(struct wl_listener *listener, void *data);
+static void output_buffer_drop(struct miniwl_output_buffer *buffer);
+static struct miniwl_output_buffer *output_acquire_buffer(struct miniwl_output *output);
+static void view_cache_invalidate(struct miniwl_view *view);
+static void cache_surface_handle_commit(struct wl_listener *listener, void *data);
+static void cache_surface_handle_destroy(struct wl_listener *listener, void *data);
+static void cache_bounds_iterator(struct wlr_surface *surface, int sx, int sy, void *data);
+static void cache_draw_iterator(struct wlr_surface *surface, int sx, int sy, void *data);
+static bool view_cache_build(struct miniwl_view *view);
+static bool view_cache_snapshot(struct miniwl_view *view, struct wlr_scene_buffer *scene_buffer, int lx, int ly, struct snapshot_data *sdata);
+static pixman_image_t *snapshot_copy(void *ptr, pixman_format_code_t format, size_t stride, const pixman_box32_t *box);
+static void snapshot_iterator(struct wlr_scene_buffer *scene_buffer, int lx, int ly, void *data);
+static void presentation_iterator(struct wlr_scene_buffer *scene_buffer, int lx, int ly, void *data);
+static bool output_render_async(struct miniwl_output *output, struct wlr_scene_output *scene_output, struct miniwl_frame_sample *sample);
+static void output_job_done(struct miniwl_render_job *render_job, void *data);
+static void output_job_destroy(struct miniwl_output_job *job);
+static bool view_frame_budget(struct wlr_scene_buffer *buffer, struct frame_done_data *fdata);
+static void send_frame_done(struct wlr_scene_buffer *buffer, int sx, int sy, void *data);
+static void scanout_candidate_iterator(struct wlr_scene_buffer *buffer, int lx, int ly, void *data);
+static int grid_cell(double v);
+static struct wl_array *grid_bucket(struct miniwl_workspace *workspace, int cx, int cy);
+static void grid_insert(struct miniwl_view *view, struct wlr_box *box);
+static void grid_remove(struct miniwl_view *view, struct wlr_box *box);
+static void view_bounds_iterator(struct wlr_surface *surface, int sx, int sy, void *data);
+static void view_grid_update(struct miniwl_view *view);
+static void server_damage_occlusion(struct miniwl_server *server);
+static void server_update_occlusion(struct miniwl_server *server);
+static bool view_at(struct miniwl_view *view, double lx, double ly, struct wlr_surface **surface, double *sx, double *sy);
+static struct miniwl_view *desktop_view_at(struct miniwl_server *server, double lx, double ly, struct wlr_surface **surface, double *sx, double *sy);
 static void server_new_output(struct wl_listener *listener, void *data);
 static void server_new_input(struct wl_listener *listener, void *data);
+static void server_new_virtual_pointer(struct wl_listener *listener, void *data);
+static void server_new_virtual_keyboard(struct wl_listener *listener, void *data);
+static void seat_update_capabilities(struct miniwl_server *server);
 static void keyboard_handle_modifiers(struct wl_listener *listener, void *data);
-static bool handle_keybinding(struct miniwl_server *server, xkb_keysym_t sym);
+static bool handle_keybinding(struct miniwl_server *server, xkb_keysym_t sym, uint32_t modifiers);
+static void server_focus_workspace(struct miniwl_server *server);
+static void server_switch_workspace(struct miniwl_server *server, struct miniwl_workspace *workspace);
+static void view_move_to_workspace(struct miniwl_view *view, struct miniwl_workspace *workspace);
 static void keyboard_handle_key(struct wl_listener *listener, void *data);
-static void server_new_keyboard(struct miniwl_server *server, struct wlr_input_device *device);
+static void keyboard_handle_destroy(struct wl_listener *listener, void *data);
+static bool keymap_name_equal(const char *a, const char *b);
+static char *keymap_name_dup(const char *name);
+static struct xkb_keymap *server_get_keymap(struct miniwl_server *server, const struct xkb_rule_names *names);
+static struct miniwl_keyboard *keyboard_create(struct miniwl_server *server, struct wlr_input_device *device);
+static void keyboard_listen(struct miniwl_keyboard *keyboard);
+static void server_new_keyboard(struct miniwl_server *server, struct wlr_input_device *device, bool physical);
 static void server_new_pointer(struct miniwl_server *server, struct wlr_input_device *device);
-static void render_surface(struct wlr_surface *surface, int sx, int sy, void *data);
 static void focus_view(struct miniwl_view *view, struct wlr_surface *surface);
+static void view_set_position(struct miniwl_view *view, int x, int y);
+static void view_set_fullscreen(struct miniwl_view *view, bool fullscreen, struct wlr_output *output);
+static void view_resize(struct miniwl_view *view, struct wlr_box *box, uint32_t edges);
+static void view_send_resize(struct miniwl_view *view);
+static void view_resize_committed(struct miniwl_view *view);
+static void view_resize_reset(struct miniwl_view *view);
+static void begin_interactive(struct miniwl_view *view, enum miniwl_cursor_mode mode, uint32_t edges);
+static void server_end_interactive(struct miniwl_server *server);
 static void xdg_surface_map(struct wl_listener *listener, void *data);
 static void xdg_surface_unmap(struct wl_listener *listener, void *data);
 static void xdg_surface_destroy(struct wl_listener *listener, void *data);
+static void xdg_surface_commit(struct wl_listener *listener, void *data);
+static void view_trace_commit(struct miniwl_view *view);
+static void xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data);
+static void xdg_toplevel_request_move(struct wl_listener *listener, void *data);
+static void xdg_toplevel_request_resize(struct wl_listener *listener, void *data);
+static void xdg_popup_destroy(struct wl_listener *listener, void *data);
 static void server_new_xdg_surface(struct wl_listener *listener, void *data);
 static void server_cursor_motion(struct wl_listener *listener, void *data);
+static void server_handle_motion(struct miniwl_server *server, uint32_t time);
+static void server_flush_motion(struct miniwl_server *server);
 static void process_cursor_motion(struct miniwl_server *server, uint32_t time);
 static void process_cursor_move(struct miniwl_server *server, uint32_t time);
 static void process_cursor_resize(struct miniwl_server *server, uint32_t time);
@@ -130,27 +448,217 @@ static void server_cursor_axis(struct wl_listener *listener, void *data);
 static void server_cursor_frame(struct wl_listener *listener, void *data);
 static void seat_request_cursor(struct wl_listener *listener, void *data);
 static void seat_request_set_selection(struct wl_listener *listener, void *data);
+static void server_new_pointer_constraint(struct wl_listener *listener, void *data);
+static void pointer_constraint_set_region(struct wl_listener *listener, void *data);
+static void pointer_constraint_destroy(struct wl_listener *listener, void *data);
+static struct wlr_pointer_constraint_v1 *server_pointer_constraint(struct miniwl_server *server, double *sx, double *sy);
+static void server_update_constraint(struct miniwl_server *server);
+static void server_unlock_cursor(struct miniwl_server *server, struct wlr_pointer_constraint_v1 *constraint);
+static void server_set_cursor_image(struct miniwl_server *server, const char *name);
+static void server_set_scheduling(int policy, int priority, int cpu);
+static int server_dispatch_clients(int fd, uint32_t mask, void *data);
+static void server_run(struct miniwl_server *server);
+static void server_terminate(struct miniwl_server *server);
+static void print_usage(const char *argv0);
+
+
+static int grid_cell(double v)
+{
+    return (int)floor(v / MINIWL_GRID_CELL_SIZE);
+}
+
+static struct wl_array *grid_bucket(struct miniwl_workspace *workspace, int cx, int cy)
+{
+    uint32_t hash = (uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u;
+    return &workspace->grid[hash % MINIWL_GRID_BUCKETS];
+}
+
+static void grid_insert(struct miniwl_view *view, struct wlr_box *box)
+{
+    if (wlr_box_empty(box))
+    {
+        return;
+    }
+    int x1 = grid_cell(box->x + box->width - 1), y1 = grid_cell(box->y + box->height - 1);
+    for (int cy = grid_cell(box->y); cy <= y1; cy++)
+    {
+        for (int cx = grid_cell(box->x); cx <= x1; cx++)
+        {
+            struct miniwl_grid_entry *entry = wl_array_add(grid_bucket(view->workspace, cx, cy), sizeof(*entry));
+            if (entry == NULL)
+            {
+                continue;
+            }
+            entry->cx = cx;
+            entry->cy = cy;
+            entry->view = view;
+        }
+    }
+}
+
+static void grid_remove(struct miniwl_view *view, struct wlr_box *box)
+{
+    if (wlr_box_empty(box))
+    {
+        return;
+    }
+    int x1 = grid_cell(box->x + box->width - 1), y1 = grid_cell(box->y + box->height - 1);
+    for (int cy = grid_cell(box->y); cy <= y1; cy++)
+    {
+        for (int cx = grid_cell(box->x); cx <= x1; cx++)
+        {
+            struct wl_array *bucket = grid_bucket(view->workspace, cx, cy);
+            struct miniwl_grid_entry *entries = bucket->data;
+            size_t len = bucket->size / sizeof(*entries);
+            for (size_t i = 0; i < len; i++)
+            {
+                if (entries[i].view == view && entries[i].cx == cx && entries[i].cy == cy)
+                {
+                    entries[i] = entries[len - 1];
+                    bucket->size -= sizeof(*entries);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void view_bounds_iterator(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+    struct wlr_box *bounds = data;
+    int x2 = sx + surface->current.width, y2 = sy + surface->current.height;
+    if (wlr_box_empty(bounds))
+    {
+        *bounds = (struct wlr_box){ .x = sx, .y = sy, .width = x2 - sx, .height = y2 - sy };
+        return;
+    }
+    int x1 = sx < bounds->x ? sx : bounds->x;
+    int y1 = sy < bounds->y ? sy : bounds->y;
+    if (bounds->x + bounds->width > x2)
+    {
+        x2 = bounds->x + bounds->width;
+    }
+    if (bounds->y + bounds->height > y2)
+    {
+        y2 = bounds->y + bounds->height;
+    }
+    *bounds = (struct wlr_box){ .x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1 };
+}
+
+static void view_grid_update(struct miniwl_view *view)
+{
+    struct wlr_box box = {0};
+    if (view->mapped)
+    {
+        struct wlr_surface *surface = view->xdg_surface->surface;
+        wlr_surface_for_each_surface(surface, view_bounds_iterator, &box);
+        box.x += view->x - view->xdg_surface->current.geometry.x;
+        box.y += view->y - view->xdg_surface->current.geometry.y;
+        if (!pixman_region32_equal(&view->opaque, &surface->opaque_region))
+        {
+            pixman_region32_copy(&view->opaque, &surface->opaque_region);
+            server_damage_occlusion(view->server);
+        }
+    }
+    if (box.x == view->grid_box.x && box.y == view->grid_box.y &&
+            box.width == view->grid_box.width && box.height == view->grid_box.height)
+    {
+        return;
+    }
+    server_damage_occlusion(view->server);
+    grid_remove(view, &view->grid_box);
+    grid_insert(view, &box);
+    view->grid_box = box;
+}
+
+static void server_damage_occlusion(struct miniwl_server *server)
+{
+    if (server->occlusion_dirty)
+    {
+        return;
+    }
+    server->occlusion_dirty = true;
+
+    /* Raising a culled view damages nothing in the scene, so make sure a
+     * frame comes to recompute occlusion. */
+    struct miniwl_output *output;
+    wl_list_for_each(output, &server->outputs, link)
+    {
+        wlr_output_schedule_frame(output->wlr_output);
+    }
+}
+
+static void server_update_occlusion(struct miniwl_server *server)
+{
+    if (!server->occlusion_dirty)
+    {
+        return;
+    }
+    server->occlusion_dirty = false;
+
+    /* Walk the views front to back, accumulating the opaque regions of their
+     * toplevel surfaces. A view whose bounds are entirely inside what is
+     * already opaque is disabled in the scene, so the scene neither renders
+     * it nor sends it frame callbacks. Views with popups are never culled,
+     * their bounds do not include the popups. */
+    pixman_region32_t opaque;
+    pixman_region32_init(&opaque);
+    struct miniwl_view *view;
+    wl_list_for_each(view, &server->workspace->views, link)
+    {
+        if (!view->mapped)
+        {
+            continue;
+        }
+        struct wlr_box *box = &view->grid_box;
+        pixman_box32_t extents = {
+                .x1 = box->x,
+                .y1 = box->y,
+                .x2 = box->x + box->width,
+                .y2 = box->y + box->height,
+        };
+        bool occluded = view->popup_count == 0 && !wlr_box_empty(box) &&
+                pixman_region32_contains_rectangle(&opaque, &extents) == PIXMAN_REGION_IN;
+        if (occluded != view->occluded)
+        {
+            view->occluded = occluded;
+            wlr_scene_node_set_enabled(&view->scene_tree->node, !occluded);
+        }
+        if (occluded)
+        {
+            continue;
+        }
 
+        struct wlr_surface *surface = view->xdg_surface->surface;
+        pixman_region32_t region;
+        pixman_region32_init(&region);
+        pixman_region32_copy(&region, &surface->opaque_region);
+        pixman_region32_translate(&region,
+                view->x - view->xdg_surface->current.geometry.x,
+                view->y - view->xdg_surface->current.geometry.y);
+        pixman_region32_union(&opaque, &opaque, &region);
+        pixman_region32_fini(&region);
+    }
+    pixman_region32_fini(&opaque);
+}
 
 static bool view_at(struct miniwl_view *view,
         double lx, double ly, struct wlr_surface **surface,
                 double *sx, double *sy)
 {
-    double view_sx = lx - view->x;
-    double view_sy = ly - view_sy;
-
-    double _sx, _sy;
-    struct wlr_surface *_surface = NULL;
-    _surface = wlr_xdg_surface_surface_at(view->xdg_surface, view_sx, view_sy, &_sx, &_sy);
-
-    if (_surface != NULL)
+    struct wlr_scene_node *node = wlr_scene_node_at(&view->scene_tree->node, lx, ly, sx, sy);
+    if (node == NULL || node->type != WLR_SCENE_NODE_BUFFER)
     {
-        *sx = _sx;
-        *sy = _sy;
-        *surface = _surface;
-        return true;
+        return false;
     }
-    return false;
+    struct wlr_scene_buffer *scene_buffer = wlr_scene_buffer_from_node(node);
+    struct wlr_scene_surface *scene_surface = wlr_scene_surface_from_buffer(scene_buffer);
+    if (scene_surface == NULL)
+    {
+        return false;
+    }
+    *surface = scene_surface->surface;
+    return true;
 }
 
 static struct miniwl_view *desktop_view_at(
@@ -158,38 +666,100 @@ static struct miniwl_view *desktop_view_at(
                 struct wlr_surface **surface, double *sx, double *sy
         )
 {
-    struct miniwl_view *view;
-    wl_list_for_each(view, &server->views, link)
+    struct miniwl_workspace *workspace = server->workspace;
+    int cx = grid_cell(lx), cy = grid_cell(ly);
+    struct wl_array *bucket = grid_bucket(workspace, cx, cy);
+
+    /* Try the candidates covering this cell from the top of the stack down;
+     * the first one the scene reports a surface for is the topmost hit. */
+    int64_t limit = INT64_MAX;
+    while (true)
     {
-        if (view_at(view, lx, ly, surface, sx, sy))
-            return view;
+        struct miniwl_view *best = NULL;
+        struct miniwl_grid_entry *entry;
+        wl_array_for_each(entry, bucket)
+        {
+            if (entry->cx == cx && entry->cy == cy && entry->view->stack < limit &&
+                    (best == NULL || entry->view->stack > best->stack))
+            {
+                best = entry->view;
+            }
+        }
+        struct miniwl_view *view;
+        wl_list_for_each(view, &workspace->grid_overflow, overflow_link)
+        {
+            if (view->mapped && view->stack < limit && (best == NULL || view->stack > best->stack))
+            {
+                best = view;
+            }
+        }
+
+        if (best == NULL)
+        {
+            return NULL;
+        }
+        if (view_at(best, lx, ly, surface, sx, sy))
+        {
+            return best;
+        }
+        limit = best->stack;
     }
-    return NULL;
 }
 
 static void server_new_output(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, new_output);
     struct wlr_output *wlr_output = data;
+    wlr_output_init_render(wlr_output, server->allocator, server->renderer);
+    wlr_output_enable(wlr_output, true);
     if (!wl_list_empty(&wlr_output->modes))
     {
         struct wlr_output_mode *mode = wlr_output_preferred_mode(wlr_output);
         wlr_output_set_mode(wlr_output, mode);
-        wlr_output_enable(wlr_output, true);
-        if (!wlr_output_commit(wlr_output))
-        {
-            return;
-        }
+    }
+    if (!wlr_output_commit(wlr_output))
+    {
+        return;
     }
 
     struct miniwl_output *output = calloc(1, sizeof(struct miniwl_output));
     output->wlr_output = wlr_output;
     output->server = server;
+    wlr_output->data = output;
+    wlr_damage_ring_init(&output->damage_ring);
 
     output->frame.notify = output_frame;
     wl_signal_add(&wlr_output->events.frame, &output->frame);
+    output->precommit.notify = output_precommit;
+    wl_signal_add(&wlr_output->events.precommit, &output->precommit);
+    output->present.notify = output_present;
+    wl_signal_add(&wlr_output->events.present, &output->present);
+    output->render_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->backend_display),
+            output_render_timer, output);
+    output->budget_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->backend_display),
+            output_budget_timer, output);
+    output->destroy.notify = output_destroy;
+    wl_signal_add(&wlr_output->events.destroy, &output->destroy);
     wl_list_insert(&server->outputs, &output->link);
+    miniwl_stats_add_output(&server->stats, &output->stats, wlr_output->name);
+    wlr_xcursor_manager_load(server->cursor_mgr, wlr_output->scale);
+    if (server->backend_display != server->wl_display)
+    {
+        /* With -P the backend creates outputs on its own display, but the
+         * wl_output global belongs on the one clients connect to. This
+         * relies on wlroots 0.16 internals: wlr_output_init has already
+         * hooked the backend display's destroy signal, and the global is
+         * only created once the output joins the layout, so the display
+         * has to be switched right before that. From here on the idle
+         * sources of wlr_output_schedule_frame and schedule_done land on
+         * the client loop, which -P dispatches on every wakeup. */
+#if MINIWL_INPUT_PRIORITY
+        wlr_output->display = server->wl_display;
+#endif
+    }
     wlr_output_layout_add_auto(server->output_layout, wlr_output);
+    server->cursor_image = NULL;
+    server_set_cursor_image(server, "left_ptr");
 }
 
 static void server_new_input(struct wl_listener *listener, void *data)
@@ -198,15 +768,37 @@ static void server_new_input(struct wl_listener *listener, void *data)
     struct wlr_input_device *device = data;
     switch (device->type) {
         case WLR_INPUT_DEVICE_KEYBOARD:
-            server_new_keyboard(server, device);
+            miniwl_trace_event(&server->trace, "device keyboard %s", device->name ? device->name : "");
+            server_new_keyboard(server, device, true);
             break;
         case WLR_INPUT_DEVICE_POINTER:
+            miniwl_trace_event(&server->trace, "device pointer %s", device->name ? device->name : "");
             server_new_pointer(server, device);
             break;
         default:
             break;
     }
+    seat_update_capabilities(server);
+}
+
+static void server_new_virtual_pointer(struct wl_listener *listener, void *data)
+{
+    struct miniwl_server *server = wl_container_of(listener, server, new_virtual_pointer);
+    struct wlr_virtual_pointer_v1_new_pointer_event *event = data;
+    server_new_pointer(server, &event->new_pointer->pointer.base);
+    seat_update_capabilities(server);
+}
 
+static void server_new_virtual_keyboard(struct wl_listener *listener, void *data)
+{
+    struct miniwl_server *server = wl_container_of(listener, server, new_virtual_keyboard);
+    struct wlr_virtual_keyboard_v1 *keyboard = data;
+    server_new_keyboard(server, &keyboard->keyboard.base, false);
+    seat_update_capabilities(server);
+}
+
+static void seat_update_capabilities(struct miniwl_server *server)
+{
     uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
     if (!wl_list_empty(&server->keyboard))
     {
@@ -222,22 +814,51 @@ static void keyboard_handle_modifiers(struct wl_listener *listener, void *data)
     wlr_seat_keyboard_notify_modifiers(keyboard->server->seat, &wlr_keyboard_from_input_device(keyboard->device)->modifiers);
 }
 
-static bool handle_keybinding(struct miniwl_server *server, xkb_keysym_t sym)
+static bool handle_keybinding(struct miniwl_server *server, xkb_keysym_t sym, uint32_t modifiers)
 {
+    struct miniwl_workspace *workspace = server->workspace;
+    if (sym >= XKB_KEY_1 && sym < XKB_KEY_1 + MINIWL_WORKSPACES)
+    {
+        struct miniwl_workspace *target = &server->workspaces[sym - XKB_KEY_1];
+        if (!(modifiers & WLR_MODIFIER_SHIFT))
+        {
+            server_switch_workspace(server, target);
+        }
+        else
+        {
+            /* Move the focused window; the head of the list may be an
+             * unmapped one, or focus may be elsewhere (e.g. cleared). */
+            struct wlr_surface *focused = server->seat->keyboard_state.focused_surface;
+            struct miniwl_view *view;
+            wl_list_for_each(view, &workspace->views, link)
+            {
+                if (view->mapped && focused != NULL && view->xdg_surface->surface == focused)
+                {
+                    view_move_to_workspace(view, target);
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
     switch (sym) {
         case XKB_KEY_Escape:
-        wl_display_terminate(server->wl_display);
+        server_terminate(server);
         break;
         case XKB_KEY_F1:
-            if (wl_list_length(&server->views) < 2)
+            if (wl_list_length(&workspace->views) < 2)
             {
                 break;
             }
-            struct miniwl_view *current_view = wl_container_of(server->views.next, current_view, link);
+            struct miniwl_view *current_view = wl_container_of(workspace->views.next, current_view, link);
             struct miniwl_view *next_view = wl_container_of(current_view->link.next, next_view, link);
             focus_view(next_view, next_view->xdg_surface->surface);
             wl_list_remove(&current_view->link);
-            wl_list_insert(server->views.prev, &current_view->link);
+            wl_list_insert(workspace->views.prev, &current_view->link);
+            wlr_scene_node_lower_to_bottom(&current_view->scene_tree->node);
+            current_view->stack = --workspace->stack_bottom;
+            server_damage_occlusion(server);
             break;
         default:
             return false;
@@ -245,12 +866,93 @@ static bool handle_keybinding(struct miniwl_server *server, xkb_keysym_t sym)
     return true;
 }
 
+static void server_focus_workspace(struct miniwl_server *server)
+{
+    struct wlr_seat *seat = server->seat;
+    struct wlr_surface *focused = seat->keyboard_state.focused_surface;
+    if (focused != NULL)
+    {
+        struct wlr_xdg_surface *xdg_surface = wlr_xdg_surface_from_wlr_surface(focused);
+        if (xdg_surface != NULL && xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL)
+        {
+            wlr_xdg_toplevel_set_activated(xdg_surface->toplevel, false);
+        }
+        wlr_seat_keyboard_notify_clear_focus(seat);
+    }
+
+    struct miniwl_view *view;
+    wl_list_for_each(view, &server->workspace->views, link)
+    {
+        if (view->mapped)
+        {
+            focus_view(view, view->xdg_surface->surface);
+            break;
+        }
+    }
+    server_update_constraint(server);
+}
+
+static void server_switch_workspace(struct miniwl_server *server, struct miniwl_workspace *workspace)
+{
+    if (workspace == server->workspace)
+    {
+        return;
+    }
+    server_end_interactive(server);
+    wlr_scene_node_set_enabled(&server->workspace->tree->node, false);
+    wlr_scene_node_set_enabled(&workspace->tree->node, true);
+    server->workspace = workspace;
+    server_focus_workspace(server);
+    server_damage_occlusion(server);
+
+    /* The pointer is now over whatever the new workspace has there. */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    server->motion_pending = false;
+    process_cursor_motion(server, now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    wlr_seat_pointer_notify_frame(server->seat);
+}
+
+static void view_move_to_workspace(struct miniwl_view *view, struct miniwl_workspace *workspace)
+{
+    struct miniwl_server *server = view->server;
+    if (view->workspace == workspace)
+    {
+        return;
+    }
+    if (server->grabbed_view == view)
+    {
+        server_end_interactive(server);
+    }
+
+    grid_remove(view, &view->grid_box);
+    view->grid_box = (struct wlr_box){0};
+    if (view->popup_count > 0)
+    {
+        wl_list_remove(&view->overflow_link);
+        wl_list_insert(&workspace->grid_overflow, &view->overflow_link);
+    }
+    wl_list_remove(&view->link);
+    wl_list_insert(&workspace->views, &view->link);
+    view->workspace = workspace;
+    view->stack = ++workspace->stack_top;
+    wlr_scene_node_reparent(&view->scene_tree->node, workspace->tree);
+    view_grid_update(view);
+
+    if (server->workspace != workspace)
+    {
+        server_focus_workspace(server);
+    }
+}
+
 static void keyboard_handle_key(struct wl_listener *listener, void *data)
 {
+    uint64_t start = miniwl_stats_now();
     struct miniwl_keyboard *keyboard = wl_container_of(listener, keyboard, key);
     struct miniwl_server *server = keyboard->server;
     struct wlr_keyboard_key_event *event = data;
     struct wlr_seat *seat = server->seat;
+    miniwl_trace_event(&server->trace, "key %u %d", event->keycode, event->state == WL_KEYBOARD_KEY_STATE_PRESSED);
 
     uint32_t keycode = event->keycode + 8;
     const xkb_keysym_t *syms;
@@ -258,74 +960,142 @@ static void keyboard_handle_key(struct wl_listener *listener, void *data)
 
     bool handled = false;
     uint32_t modifiers = wlr_keyboard_get_modifiers(wlr_keyboard_from_input_device(keyboard->device));
-    if ((modifiers & WLR_MODIFIER_ALT) && event->state == WL_KEYBOARD_KEY_STATE_RELEASED)
+    if ((modifiers & WLR_MODIFIER_ALT) && event->state == WL_KEYBOARD_KEY_STATE_PRESSED)
     {
-        for (int i = 0; i < nsyms; i++)
+        /* Alt+Shift+digit moves a view; match on the unshifted symbols so it
+         * works whatever the layout puts above the digits. */
+        if (modifiers & WLR_MODIFIER_SHIFT)
         {
-            handled = handle_keybinding(server, syms[i]);
+            struct xkb_state *state = wlr_keyboard_from_input_device(keyboard->device)->xkb_state;
+            nsyms = xkb_keymap_key_get_syms_by_level(xkb_state_get_keymap(state), keycode,
+                    xkb_state_key_get_layout(state, keycode), 0, &syms);
         }
-
-        if (!handled)
+        for (int i = 0; i < nsyms; i++)
         {
-            wlr_seat_set_keyboard(seat, wlr_keyboard_from_input_device(keyboard->device));
-            wlr_seat_keyboard_notify_key(seat, event->time_msec, event->keycode, event->state);
+            handled |= handle_keybinding(server, syms[i], modifiers);
         }
     }
+
+    if (!handled)
+    {
+        wlr_seat_set_keyboard(seat, wlr_keyboard_from_input_device(keyboard->device));
+        wlr_seat_keyboard_notify_key(seat, event->time_msec, event->keycode, event->state);
+    }
+    miniwl_stats_record_input(&server->stats, MINIWL_INPUT_KEY, start);
 }
 
-static void server_new_keyboard(struct miniwl_server *server, struct wlr_input_device *device)
+static void keyboard_handle_destroy(struct wl_listener *listener, void *data)
 {
-    struct miniwl_keyboard *keyboard = calloc(1, sizeof(struct miniwl_keyboard));
-    keyboard->server = server;
-    keyboard->device = device;
-
-    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-    struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
-
-    wlr_keyboard_set_keymap(wlr_keyboard_from_input_device(device), keymap);
-    xkb_keymap_ref(keymap);
-    xkb_context_unref(context);
-    wlr_keyboard_set_repeat_info(wlr_keyboard_from_input_device(device), 25, 600);
-
-    keyboard->modifiers.notify = keyboard_handle_modifiers;
-    wl_signal_add(&wlr_keyboard_from_input_device(device)->events.modifiers, &keyboard->modifiers);
-    keyboard->key.notify = keyboard_handle_key;
+    struct miniwl_keyboard *keyboard = wl_container_of(listener, keyboard, destroy);
+    struct miniwl_server *server = keyboard->server;
+    wl_list_remove(&keyboard->modifiers.link);
+    wl_list_remove(&keyboard->key.link);
+    wl_list_remove(&keyboard->destroy.link);
+    wl_list_remove(&keyboard->link);
+    free(keyboard);
+    seat_update_capabilities(server);
 }
 
-static void server_new_pointer(struct miniwl_server *server, struct wlr_input_device *device)
+static bool keymap_name_equal(const char *a, const char *b)
 {
-    wlr_cursor_attach_input_device(server->cursor, device);
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
 }
 
-static void render_surface(struct wlr_surface *surface, int sx, int sy, void *data)
+static char *keymap_name_dup(const char *name)
 {
-    struct render_data *rdata = data;
-    struct miniwl_view *view = rdata->view;
-    struct wlr_output *output = rdata->output;
+    return name != NULL ? strdup(name) : NULL;
+}
 
-    struct wlr_texture *texture = wlr_surface_get_texture(surface);
-    if (texture == NULL)
+static struct xkb_keymap *server_get_keymap(struct miniwl_server *server, const struct xkb_rule_names *names)
+{
+    struct miniwl_keymap *entry;
+    wl_list_for_each(entry, &server->keymaps, link)
     {
-        return ;
+        if (keymap_name_equal(entry->rules, names->rules) && keymap_name_equal(entry->model, names->model) &&
+                keymap_name_equal(entry->layout, names->layout) && keymap_name_equal(entry->variant, names->variant) &&
+                keymap_name_equal(entry->options, names->options))
+        {
+            return entry->keymap;
+        }
     }
 
-    double ox = 0, oy = 0;
-    wlr_output_layout_output_coords(view->server->output_layout, output, &ox, &oy);
-    ox == view->x + sx;
-    oy += view->y + sy;
+    struct xkb_keymap *keymap = xkb_keymap_new_from_names(server->xkb_context, names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (keymap == NULL)
+    {
+        return NULL;
+    }
+    entry = calloc(1, sizeof(struct miniwl_keymap));
+    entry->rules = keymap_name_dup(names->rules);
+    entry->model = keymap_name_dup(names->model);
+    entry->layout = keymap_name_dup(names->layout);
+    entry->variant = keymap_name_dup(names->variant);
+    entry->options = keymap_name_dup(names->options);
+    entry->keymap = keymap;
+    wl_list_insert(&server->keymaps, &entry->link);
+    return keymap;
+}
 
-    struct wlr_box box = {
-            .x = ox * output->scale,
-            .y = oy * output->scale,
-            .width = surface->current.width * output->scale,
-            .height = surface->current.height * output->scale,
+static struct miniwl_keyboard *keyboard_create(struct miniwl_server *server, struct wlr_input_device *device)
+{
+    struct miniwl_keyboard *keyboard = calloc(1, sizeof(struct miniwl_keyboard));
+    keyboard->server = server;
+    keyboard->device = device;
+
+    /* Unset names fall back to the XKB_DEFAULT_* environment, as before. */
+    struct xkb_rule_names names = {
+            .rules = getenv("XKB_DEFAULT_RULES"),
+            .model = getenv("XKB_DEFAULT_MODEL"),
+            .layout = getenv("XKB_DEFAULT_LAYOUT"),
+            .variant = getenv("XKB_DEFAULT_VARIANT"),
+            .options = getenv("XKB_DEFAULT_OPTIONS"),
     };
+    wlr_keyboard_set_keymap(wlr_keyboard_from_input_device(device), server_get_keymap(server, &names));
+    wlr_keyboard_set_repeat_info(wlr_keyboard_from_input_device(device), 25, 600);
+
+    wl_list_init(&keyboard->modifiers.link);
+    wl_list_init(&keyboard->key.link);
+    keyboard->destroy.notify = keyboard_handle_destroy;
+    wl_signal_add(&device->events.destroy, &keyboard->destroy);
+    wl_list_init(&keyboard->link);
+    return keyboard;
+}
+
+static void keyboard_listen(struct miniwl_keyboard *keyboard)
+{
+    struct wlr_keyboard *wlr_keyboard = wlr_keyboard_from_input_device(keyboard->device);
+    keyboard->modifiers.notify = keyboard_handle_modifiers;
+    wl_signal_add(&wlr_keyboard->events.modifiers, &keyboard->modifiers);
+    keyboard->key.notify = keyboard_handle_key;
+    wl_signal_add(&wlr_keyboard->events.key, &keyboard->key);
+}
+
+static void server_new_keyboard(struct miniwl_server *server, struct wlr_input_device *device, bool physical)
+{
+    /* Physical keyboards share the default keymap and join one keyboard
+     * group, so the seat sees a single stable keyboard however many devices
+     * are plugged in. Virtual keyboards bring their own keymaps.
+     *
+     * The compiled keymap is shared, but wlr_keyboard_set_keymap still
+     * serialises it and creates a shm file for every device, and the group
+     * only accepts members whose keymap matches its own, so each member
+     * keeps its copy even though only the group's is ever sent. */
+    if (physical && server->group_keyboard == NULL)
+    {
+        server->keyboard_group = wlr_keyboard_group_create();
+        server->group_keyboard = keyboard_create(server, &server->keyboard_group->keyboard.base);
+        keyboard_listen(server->group_keyboard);
+    }
+    struct miniwl_keyboard *keyboard = keyboard_create(server, device);
+    if (!physical || !wlr_keyboard_group_add_keyboard(server->keyboard_group, wlr_keyboard_from_input_device(device)))
+    {
+        keyboard_listen(keyboard);
+    }
+    wl_list_insert(&server->keyboard, &keyboard->link);
+}
 
-    float matrix[9] = {0};
-    enum wl_output_transform transform = wlr_output_transform_invert(surface->current.transform);
-    wlr_matrix_project_box(matrix, &box, transform, 0, output->transform_matrix);
-    wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
-    wlr_surface_send_frame_done(surface, rdata->when);
+static void server_new_pointer(struct miniwl_server *server, struct wlr_input_device *device)
+{
+    wlr_cursor_attach_input_device(server->cursor, device);
 }
 
 static void focus_view(struct miniwl_view *view, struct wlr_surface *surface)
@@ -337,86 +1107,1287 @@ static void focus_view(struct miniwl_view *view, struct wlr_surface *surface)
     struct miniwl_server *server = view->server;
     struct wlr_seat *seat = server->seat;
     struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
-    if (prev_surface == surface)
+    if (view->workspace != server->workspace || prev_surface == surface)
+    {
+        return ;
+    }
+    if (prev_surface)
+    {
+        struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(seat->keyboard_state.focused_surface);
+        wlr_xdg_toplevel_set_activated(previous->toplevel, false);
+    }
+    struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
+
+    wl_list_remove(&view->link);
+    wl_list_insert(&view->workspace->views, &view->link);
+    wlr_scene_node_raise_to_top(&view->scene_tree->node);
+    view->stack = ++view->workspace->stack_top;
+    server_damage_occlusion(server);
+    wlr_xdg_toplevel_set_activated(view->xdg_surface->toplevel, true);
+    if (keyboard != NULL)
+    {
+        wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface, keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+    }
+    else
+    {
+        wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface, NULL, 0, NULL);
+    }
+    server_update_constraint(server);
+}
+
+static void xdg_surface_map(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, map);
+    struct wlr_box geo;
+    wlr_xdg_surface_get_geometry(view->xdg_surface, &geo);
+    miniwl_trace_event(&view->server->trace, "map %u %d %d", view->id, geo.width, geo.height);
+    snprintf(view->stats.app_id, sizeof(view->stats.app_id), "%s",
+            view->xdg_surface->toplevel->app_id ? view->xdg_surface->toplevel->app_id : "");
+    view->mapped = true;
+    view->cache_dirty_ns = miniwl_stats_now();
+    server_damage_occlusion(view->server);
+    view_grid_update(view);
+    focus_view(view, view->xdg_surface->surface);
+}
+
+static void xdg_surface_unmap(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, unmap);
+    miniwl_trace_event(&view->server->trace, "unmap %u", view->id);
+    view->mapped = false;
+    view_cache_invalidate(view);
+    server_damage_occlusion(view->server);
+    view_grid_update(view);
+}
+
+static void xdg_surface_destroy(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, destroy);
+    miniwl_trace_event(&view->server->trace, "destroy %u", view->id);
+    miniwl_stats_remove_view(&view->stats);
+    wl_list_remove(&view->map.link);
+    wl_list_remove(&view->unmap.link);
+    wl_list_remove(&view->destroy.link);
+    wl_list_remove(&view->commit.link);
+    wl_list_remove(&view->request_fullscreen.link);
+    wl_list_remove(&view->request_move.link);
+    wl_list_remove(&view->request_resize.link);
+    wl_list_remove(&view->link);
+    if (view->server->grabbed_view == view)
+    {
+        view->server->grabbed_view = NULL;
+        view->server->cursor_mode = MINIWL_CURSOR_PASSTHROUGH;
+    }
+    grid_remove(view, &view->grid_box);
+    server_damage_occlusion(view->server);
+    if (view->popup_count > 0)
+    {
+        wl_list_remove(&view->overflow_link);
+    }
+    wlr_scene_node_destroy(&view->scene_tree->node);
+    view_cache_invalidate(view);
+    wl_array_release(&view->cache_surfaces);
+    pixman_region32_fini(&view->opaque);
+    free(view);
+}
+
+static void xdg_surface_commit(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, commit);
+    if (view->server->trace.f != NULL)
+    {
+        view_trace_commit(view);
+    }
+    if (view->resize_serial != 0 &&
+            (int32_t)(view->xdg_surface->current.configure_serial - view->resize_serial) >= 0)
+    {
+        view_resize_committed(view);
+    }
+    view_grid_update(view);
+}
+
+static void view_trace_commit(struct miniwl_view *view)
+{
+    struct wlr_surface *surface = view->xdg_surface->surface;
+    if (surface->buffer == NULL)
+    {
+        return;
+    }
+    int nrects;
+    pixman_region32_rectangles(&surface->buffer_damage, &nrects);
+    const pixman_box32_t *extents = pixman_region32_extents(&surface->buffer_damage);
+    miniwl_trace_event(&view->server->trace, "commit %u %d %d %d %d %d %d %d", view->id,
+            surface->buffer->base.width, surface->buffer->base.height,
+            extents->x1, extents->y1, extents->x2, extents->y2, nrects);
+}
+
+static void xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, request_fullscreen);
+    struct wlr_xdg_toplevel *toplevel = view->xdg_surface->toplevel;
+    miniwl_trace_event(&view->server->trace, "fullscreen %u %d", view->id, toplevel->requested.fullscreen);
+    view_set_fullscreen(view, toplevel->requested.fullscreen, toplevel->requested.fullscreen_output);
+}
+
+static void xdg_toplevel_request_move(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, request_move);
+    begin_interactive(view, MINIWL_CURSOR_MOVE, 0);
+}
+
+static void xdg_toplevel_request_resize(struct wl_listener *listener, void *data)
+{
+    struct miniwl_view *view = wl_container_of(listener, view, request_resize);
+    struct wlr_xdg_toplevel_resize_event *event = data;
+    begin_interactive(view, MINIWL_CURSOR_RESIZE, event->edges);
+}
+
+static void xdg_popup_destroy(struct wl_listener *listener, void *data)
+{
+    struct miniwl_popup *popup = wl_container_of(listener, popup, destroy);
+    if (--popup->view->popup_count == 0)
+    {
+        /* The view may be culled again now. */
+        wl_list_remove(&popup->view->overflow_link);
+        server_damage_occlusion(popup->view->server);
+    }
+    wl_list_remove(&popup->destroy.link);
+    free(popup);
+}
+
+static void view_set_position(struct miniwl_view *view, int x, int y)
+{
+    view->x = x;
+    view->y = y;
+    wlr_scene_node_set_position(&view->scene_tree->node, x, y);
+    view_grid_update(view);
+}
+
+static void view_set_fullscreen(struct miniwl_view *view, bool fullscreen, struct wlr_output *output)
+{
+    struct miniwl_server *server = view->server;
+    struct wlr_xdg_toplevel *toplevel = view->xdg_surface->toplevel;
+    if (fullscreen)
+    {
+        if (output == NULL)
+        {
+            struct wlr_box geo_box;
+            wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+            output = wlr_output_layout_output_at(server->output_layout,
+                    view->x + geo_box.width / 2, view->y + geo_box.height / 2);
+        }
+        if (output == NULL)
+        {
+            output = wlr_output_layout_get_center_output(server->output_layout);
+        }
+        if (output == NULL)
+        {
+            wlr_xdg_surface_schedule_configure(view->xdg_surface);
+            return ;
+        }
+        if (server->grabbed_view == view)
+        {
+            server->grabbed_view = NULL;
+            server->cursor_mode = MINIWL_CURSOR_PASSTHROUGH;
+        }
+        view_resize_reset(view);
+        if (!view->fullscreen)
+        {
+            wlr_xdg_surface_get_geometry(view->xdg_surface, &view->saved_box);
+            view->saved_box.x = view->x;
+            view->saved_box.y = view->y;
+        }
+
+        /* Sized and placed to cover the output exactly, the view's buffer
+         * is what the scene tries to scan out directly. */
+        struct wlr_box output_box;
+        wlr_output_layout_get_box(server->output_layout, output, &output_box);
+        view->fullscreen = true;
+        wlr_xdg_toplevel_set_fullscreen(toplevel, true);
+        wlr_xdg_toplevel_set_size(toplevel, output_box.width, output_box.height);
+        view_set_position(view, output_box.x, output_box.y);
+        focus_view(view, view->xdg_surface->surface);
+    }
+    else if (view->fullscreen)
+    {
+        view->fullscreen = false;
+        view_resize_reset(view);
+        wlr_xdg_toplevel_set_fullscreen(toplevel, false);
+        wlr_xdg_toplevel_set_size(toplevel, view->saved_box.width, view->saved_box.height);
+        view_set_position(view, view->saved_box.x, view->saved_box.y);
+    }
+    else
+    {
+        wlr_xdg_surface_schedule_configure(view->xdg_surface);
+    }
+}
+
+static void view_resize(struct miniwl_view *view, struct wlr_box *box, uint32_t edges)
+{
+    view->resize_box = *box;
+    view->resize_edges = edges;
+    if (view->resize_serial != 0)
+    {
+        if (view->resize_pending)
+        {
+            view->server->stats.resize_dropped++;
+        }
+        view->resize_pending = true;
+        return ;
+    }
+    view_send_resize(view);
+}
+
+static void view_send_resize(struct miniwl_view *view)
+{
+    view->resize_pending = false;
+    view->resize_inflight = view->resize_box;
+    view->resize_sent_ns = miniwl_stats_now();
+    view->resize_serial = wlr_xdg_toplevel_set_size(view->xdg_surface->toplevel,
+            view->resize_box.width, view->resize_box.height);
+}
+
+static void view_resize_committed(struct miniwl_view *view)
+{
+    /* Move the view only once the client has drawn the new size, keeping
+     * the dragged edges under the cursor and the opposite ones still. */
+    struct wlr_box geo_box;
+    wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+    struct wlr_box *box = &view->resize_inflight;
+    int x = box->x, y = box->y;
+    if (view->resize_edges & WLR_EDGE_LEFT)
+    {
+        x = box->x + box->width - geo_box.width;
+    }
+    if (view->resize_edges & WLR_EDGE_TOP)
+    {
+        y = box->y + box->height - geo_box.height;
+    }
+    view_set_position(view, x, y);
+
+    miniwl_histogram_add(&view->server->stats.resize, miniwl_stats_now() - view->resize_sent_ns);
+    view->resize_serial = 0;
+    if (view->resize_pending)
+    {
+        view_send_resize(view);
+    }
+}
+
+static void view_resize_reset(struct miniwl_view *view)
+{
+    /* Forget the configure in flight and the queued one, so a later ack
+     * cannot move the view to a stale box. */
+    view->resize_serial = 0;
+    view->resize_inflight = (struct wlr_box){0};
+    view->resize_pending = false;
+}
+
+static void begin_interactive(struct miniwl_view *view, enum miniwl_cursor_mode mode, uint32_t edges)
+{
+    struct miniwl_server *server = view->server;
+    struct wlr_surface *focused_surface = server->seat->pointer_state.focused_surface;
+    if (view->fullscreen || focused_surface == NULL ||
+            view->xdg_surface->surface != wlr_surface_get_root_surface(focused_surface))
+    {
+        return ;
+    }
+    server->grabbed_view = view;
+    server->cursor_mode = mode;
+
+    if (mode == MINIWL_CURSOR_MOVE)
+    {
+        server->grab_x = server->cursor->x - view->x;
+        server->grab_y = server->cursor->y - view->y;
+    }
+    else
+    {
+        struct wlr_box geo_box;
+        wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+        double border_x = view->x + ((edges & WLR_EDGE_RIGHT) ? geo_box.width : 0);
+        double border_y = view->y + ((edges & WLR_EDGE_BOTTOM) ? geo_box.height : 0);
+        server->grab_x = server->cursor->x - border_x;
+        server->grab_y = server->cursor->y - border_y;
+        server->grab_geobox = (struct wlr_box){
+                .x = view->x,
+                .y = view->y,
+                .width = geo_box.width,
+                .height = geo_box.height,
+        };
+        server->resize_edges = edges;
+    }
+}
+
+static void server_end_interactive(struct miniwl_server *server)
+{
+    /* A resize configure still in flight outlives the grab: its ack places
+     * the view through view_resize_committed, which then sends the last
+     * queued size the same way. Placing it now would show the old buffer
+     * at the new origin. */
+    server->grabbed_view = NULL;
+    server->cursor_mode = MINIWL_CURSOR_PASSTHROUGH;
+}
+
+static void scanout_candidate_iterator(struct wlr_scene_buffer *buffer, int lx, int ly, void *data)
+{
+    struct scanout_data *sdata = data;
+    struct wlr_output *wlr_output = sdata->scene_output->output;
+    if (++sdata->count == 1 && buffer->buffer != NULL &&
+            lx == sdata->scene_output->x && ly == sdata->scene_output->y &&
+            buffer->buffer->width == wlr_output->width && buffer->buffer->height == wlr_output->height)
+    {
+        sdata->buffer = buffer;
+    }
+}
+
+static bool view_frame_budget(struct wlr_scene_buffer *buffer, struct frame_done_data *fdata)
+{
+    struct wlr_scene_surface *scene_surface = wlr_scene_surface_from_buffer(buffer);
+    if (scene_surface == NULL || wl_list_empty(&scene_surface->surface->current.frame_callback_list))
+    {
+        return true;
+    }
+    struct wlr_scene_tree *tree = buffer->node.parent;
+    while (tree != NULL && tree->node.data == NULL)
+    {
+        tree = tree->node.parent;
+    }
+    if (tree == NULL)
+    {
+        return true;
+    }
+
+    /* Decide once per view and output frame, so a view's subsurfaces and
+     * popups are paced together. */
+    struct miniwl_view *view = tree->node.data;
+    if (view->frame_pass_ns == fdata->now_ns)
+    {
+        return view->frame_pass_sent;
+    }
+    view->frame_pass_ns = fdata->now_ns;
+
+    struct miniwl_server *server = view->server;
+    uint64_t interval = server->unfocused_frame_ns;
+    bool focused = server->seat->keyboard_state.focused_surface == view->xdg_surface->surface;
+    view->frame_pass_sent = interval == 0 || focused ||
+            (interval != UINT64_MAX && fdata->now_ns - view->frame_done_ns >= interval);
+    if (view->frame_pass_sent)
+    {
+        view->frame_done_ns = fdata->now_ns;
+        view->stats.frames++;
+        return true;
+    }
+    view->stats.throttled++;
+    if (interval != UINT64_MAX && view->frame_done_ns + interval < fdata->wakeup_ns)
+    {
+        fdata->wakeup_ns = view->frame_done_ns + interval;
+    }
+    return false;
+}
+
+static void send_frame_done(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+    /* The scene sends wl_surface.enter/leave as buffers cross outputs and
+     * picks the output showing most of each buffer as its primary. Frame
+     * callbacks go out from that output only, so a client spanning several
+     * outputs paints once per refresh of one of them; culled and off-screen
+     * buffers are not visited at all. */
+    struct frame_done_data *fdata = data;
+    if (buffer->primary_output == fdata->scene_output)
+    {
+        if (view_frame_budget(buffer, fdata))
+        {
+            wlr_scene_buffer_send_frame_done(buffer, fdata->when);
+        }
+        fdata->count++;
+    }
+    else
+    {
+        fdata->deferred++;
+    }
+}
+
+static void output_frame(struct wl_listener *listener, void *data)
+{
+    struct miniwl_output *output = wl_container_of(listener, output, frame);
+    miniwl_stats_wakeup(&output->server->stats, miniwl_stats_now());
+    if (output->job != NULL)
+    {
+        output->frame_pending = true;
+        return;
+    }
+    if (output->render_scheduled)
+    {
+        return;
+    }
+    output->frame_ns = miniwl_stats_now();
+    int delay = output_latch_delay(output);
+    if (delay > 0)
+    {
+        output->render_scheduled = true;
+        wl_event_source_timer_update(output->render_timer, delay);
+        return;
+    }
+    output_render(output);
+}
+
+static int output_budget_timer(void *data)
+{
+    struct miniwl_output *output = data;
+    miniwl_stats_wakeup(&output->server->stats, miniwl_stats_now());
+    wlr_output_schedule_frame(output->wlr_output);
+    return 0;
+}
+
+static int output_render_timer(void *data)
+{
+    struct miniwl_output *output = data;
+    miniwl_stats_wakeup(&output->server->stats, miniwl_stats_now());
+    output->render_scheduled = false;
+    output_render(output);
+    return 0;
+}
+
+static uint64_t output_predict_render(struct miniwl_output *output)
+{
+    /* The slowest of the recent frames; a miss costs a whole refresh, so
+     * this errs on the early side. */
+    uint64_t count = output->render_history_len < MINIWL_RENDER_HISTORY ?
+            output->render_history_len : MINIWL_RENDER_HISTORY;
+    uint64_t slowest = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (output->render_history[i] > slowest)
+        {
+            slowest = output->render_history[i];
+        }
+    }
+    return slowest;
+}
+
+static int output_latch_delay(struct miniwl_output *output)
+{
+    /* Frames are only scheduled when something changed. Rather than render
+     * as soon as the frame event fires, wait until the next vblank, predicted
+     * from the last presentation, minus the predicted render time and the
+     * margin, so input arriving meanwhile still makes it into this frame. */
+    struct miniwl_server *server = output->server;
+    output->deadline_ns = 0;
+    if (!server->late_latch || output->refresh_ns == 0 || output->last_present_ns == 0 ||
+            output->render_history_len == 0)
+    {
+        return 0;
+    }
+    uint64_t now = output->frame_ns;
+    uint64_t deadline = output->last_present_ns + output->refresh_ns;
+    if (deadline <= now)
+    {
+        deadline += ((now - deadline) / output->refresh_ns + 1) * output->refresh_ns;
+    }
+    output->deadline_ns = deadline;
+
+    /* Timers have millisecond resolution; round the wait down. */
+    uint64_t budget = output_predict_render(output) + server->latch_margin_ns;
+    if (deadline - now <= budget)
+    {
+        return 0;
+    }
+    return (deadline - now - budget) / 1000000;
+}
+
+static void output_render(struct miniwl_output *output)
+{
+    struct wlr_scene_output *scene_output = wlr_scene_get_scene_output(output->server->scene, output->wlr_output);
+    server_flush_motion(output->server);
+    server_update_occlusion(output->server);
+
+    struct miniwl_frame_sample *sample = miniwl_output_stats_begin_frame(&output->stats);
+    miniwl_histogram_add(&output->stats.latch, sample->begin_ns - output->frame_ns);
+
+    /* The scene scans a client buffer out directly, after a test commit, when
+     * it is the only thing on the output and matches it exactly; otherwise it
+     * composites. Note the candidate so precommit can tell which happened,
+     * and leave such frames to the scene even with the render pool on, which
+     * would only copy the buffer. */
+    struct scanout_data sdata = {
+            .scene_output = scene_output,
+    };
+    wlr_scene_output_for_each_buffer(scene_output, scanout_candidate_iterator, &sdata);
+    bool scanout_candidate = sdata.count == 1 && sdata.buffer != NULL;
+    if (!scanout_candidate && output->server->render_pool.nthreads > 0 &&
+            output_render_async(output, scene_output, sample))
+    {
+        return;
+    }
+
+    /* The scene renders and commits in one call; the precommit hook marks
+     * where rendering ended. */
+    output->frame_sample = sample;
+    if (scanout_candidate)
+    {
+        sample->scanout_candidate = true;
+        output->scanout_buffer = sdata.buffer->buffer;
+    }
+    if (output->render_async_last && pixman_region32_not_empty(&scene_output->damage_ring.current))
+    {
+        wlr_damage_ring_add_whole(&scene_output->damage_ring);
+    }
+    wlr_scene_output_commit(scene_output);
+    output->frame_sample = NULL;
+    output->scanout_buffer = NULL;
+    if (sample->committed)
+    {
+        output->render_async_last = false;
+    }
+    output_frame_done(output, scene_output, sample);
+}
+
+static void output_frame_done(struct miniwl_output *output, struct wlr_scene_output *scene_output, struct miniwl_frame_sample *sample)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct frame_done_data fdata = {
+            .scene_output = scene_output,
+            .when = &now,
+            .now_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+            .wakeup_ns = UINT64_MAX,
+    };
+    wlr_scene_output_for_each_buffer(scene_output, send_frame_done, &fdata);
+    if (fdata.wakeup_ns != UINT64_MAX)
+    {
+        /* Nothing else may damage the output before the budget runs out. */
+        wl_event_source_timer_update(output->budget_timer, (fdata.wakeup_ns - fdata.now_ns) / 1000000 + 1);
+    }
+    sample->surfaces = fdata.count;
+    sample->deferred = fdata.deferred;
+    miniwl_output_stats_end_frame(&output->stats, sample);
+    if (sample->committed)
+    {
+        output->render_history[output->render_history_len++ % MINIWL_RENDER_HISTORY] =
+                sample->commit_end_ns - sample->begin_ns;
+        if (sample->present_ns != 0)
+        {
+            /* Presented during the commit. */
+            miniwl_output_stats_present(&output->stats, sample, output->refresh_ns);
+        }
+    }
+    else
+    {
+        output->deadline_ns = 0;
+    }
+}
+
+static pixman_format_code_t pixman_format_from_drm(uint32_t format)
+{
+    switch (format)
+    {
+        case DRM_FORMAT_ARGB8888:
+            return PIXMAN_a8r8g8b8;
+        case DRM_FORMAT_XRGB8888:
+            return PIXMAN_x8r8g8b8;
+        case DRM_FORMAT_ABGR8888:
+            return PIXMAN_a8b8g8r8;
+        case DRM_FORMAT_XBGR8888:
+            return PIXMAN_x8b8g8r8;
+        default:
+            return 0;
+    }
+}
+
+static void output_buffer_handle_release(struct wl_listener *listener, void *data)
+{
+    struct miniwl_output_buffer *buffer = wl_container_of(listener, buffer, release);
+    buffer->busy = false;
+}
+
+static void output_buffer_drop(struct miniwl_output_buffer *buffer)
+{
+    wl_list_remove(&buffer->release.link);
+    wlr_buffer_drop(buffer->buffer);
+    buffer->buffer = NULL;
+    buffer->busy = false;
+    buffer->seq = 0;
+}
+
+static struct miniwl_output_buffer *output_acquire_buffer(struct miniwl_output *output)
+{
+    struct wlr_output *wlr_output = output->wlr_output;
+    struct miniwl_output_buffer *best = NULL;
+    for (int i = 0; i < MINIWL_RENDER_BUFFERS; i++)
+    {
+        struct miniwl_output_buffer *buffer = &output->buffers[i];
+        if (buffer->busy)
+        {
+            continue;
+        }
+        if (buffer->buffer != NULL &&
+                (buffer->buffer->width != wlr_output->width || buffer->buffer->height != wlr_output->height))
+        {
+            output_buffer_drop(buffer);
+        }
+        /* Prefer the most recently rendered buffer, it needs the least
+         * repainting. */
+        if (best == NULL || (buffer->buffer != NULL && (best->buffer == NULL || buffer->seq > best->seq)))
+        {
+            best = buffer;
+        }
+    }
+    if (best == NULL || best->buffer != NULL)
+    {
+        return best;
+    }
+
+    struct wlr_drm_format *format = calloc(1, sizeof(struct wlr_drm_format) + sizeof(uint64_t));
+    format->format = DRM_FORMAT_XRGB8888;
+    format->len = 1;
+    format->capacity = 1;
+    format->modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+    best->buffer = wlr_allocator_create_buffer(output->server->allocator, wlr_output->width, wlr_output->height, format);
+    free(format);
+    if (best->buffer == NULL)
+    {
+        return NULL;
+    }
+    best->output = output;
+    best->seq = 0;
+    best->release.notify = output_buffer_handle_release;
+    wl_signal_add(&best->buffer->events.release, &best->release);
+    return best;
+}
+
+static void view_cache_invalidate(struct miniwl_view *view)
+{
+    view->cache_dirty_ns = miniwl_stats_now();
+    if (view->cache == NULL)
+    {
+        return;
+    }
+    pixman_image_unref(view->cache);
+    view->cache = NULL;
+    struct miniwl_cache_surface **entry;
+    wl_array_for_each(entry, &view->cache_surfaces)
+    {
+        wl_list_remove(&(*entry)->commit.link);
+        wl_list_remove(&(*entry)->destroy.link);
+        free(*entry);
+    }
+    view->cache_surfaces.size = 0;
+}
+
+static void cache_surface_handle_commit(struct wl_listener *listener, void *data)
+{
+    struct miniwl_cache_surface *entry = wl_container_of(listener, entry, commit);
+    view_cache_invalidate(entry->view);
+}
+
+static void cache_surface_handle_destroy(struct wl_listener *listener, void *data)
+{
+    struct miniwl_cache_surface *entry = wl_container_of(listener, entry, destroy);
+    view_cache_invalidate(entry->view);
+}
+
+static void cache_bounds_iterator(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+    /* Only plain buffers are flattened: no buffer scale, transform or
+     * viewport, so surface and buffer pixels match. */
+    struct cache_build *build = data;
+    struct wlr_surface_state *state = &surface->current;
+    if (surface->buffer == NULL)
+    {
+        return;
+    }
+    if (state->scale != 1 || state->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+            state->viewport.has_src || state->viewport.has_dst ||
+            surface->buffer->base.width != state->width || surface->buffer->base.height != state->height)
+    {
+        build->ok = false;
+        return;
+    }
+    pixman_box32_t box = { sx, sy, sx + state->width, sy + state->height };
+    if (build->count++ == 0)
+    {
+        build->bounds = box;
+        return;
+    }
+    build->bounds.x1 = box.x1 < build->bounds.x1 ? box.x1 : build->bounds.x1;
+    build->bounds.y1 = box.y1 < build->bounds.y1 ? box.y1 : build->bounds.y1;
+    build->bounds.x2 = box.x2 > build->bounds.x2 ? box.x2 : build->bounds.x2;
+    build->bounds.y2 = box.y2 > build->bounds.y2 ? box.y2 : build->bounds.y2;
+}
+
+static void cache_draw_iterator(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+    struct cache_build *build = data;
+    struct miniwl_view *view = build->view;
+    if (!build->ok || surface->buffer == NULL)
+    {
+        return;
+    }
+    struct miniwl_cache_surface *entry = calloc(1, sizeof(struct miniwl_cache_surface));
+    struct miniwl_cache_surface **slot = entry != NULL ? wl_array_add(&view->cache_surfaces, sizeof(*slot)) : NULL;
+    if (slot == NULL)
+    {
+        free(entry);
+        build->ok = false;
+        return;
+    }
+    *slot = entry;
+    entry->view = view;
+    entry->surface = surface;
+    entry->x = sx - build->bounds.x1;
+    entry->y = sy - build->bounds.y1;
+    entry->commit.notify = cache_surface_handle_commit;
+    wl_signal_add(&surface->events.commit, &entry->commit);
+    entry->destroy.notify = cache_surface_handle_destroy;
+    wl_signal_add(&surface->events.destroy, &entry->destroy);
+
+    struct wlr_buffer *buffer = &surface->buffer->base;
+    void *ptr;
+    uint32_t format;
+    size_t stride;
+    if (!wlr_buffer_begin_data_ptr_access(buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &ptr, &format, &stride))
+    {
+        build->ok = false;
+        return;
+    }
+    pixman_format_code_t pixman_format = pixman_format_from_drm(format);
+    pixman_image_t *image = pixman_format != 0 ?
+            pixman_image_create_bits_no_clear(pixman_format, buffer->width, buffer->height, ptr, stride) : NULL;
+    if (image == NULL)
+    {
+        build->ok = false;
+    }
+    else
+    {
+        pixman_box32_t box = { 0, 0, pixman_image_get_width(build->image), pixman_image_get_height(build->image) };
+        if (!miniwl_composite_blit(view->server->render_pool.composite, build->image, image, entry->x, entry->y, 1, &box))
+        {
+            pixman_image_composite32(PIXMAN_OP_OVER, image, NULL, build->image, 0, 0, 0, 0,
+                    entry->x, entry->y, buffer->width, buffer->height);
+        }
+        pixman_image_unref(image);
+    }
+    wlr_buffer_end_data_ptr_access(buffer);
+}
+
+static bool view_cache_build(struct miniwl_view *view)
+{
+    struct miniwl_server *server = view->server;
+    struct wlr_surface *root = view->xdg_surface->surface;
+    struct cache_build build = {
+            .view = view,
+            .ok = true,
+    };
+    wlr_surface_for_each_surface(root, cache_bounds_iterator, &build);
+    if (!build.ok || build.count < server->flatten_surfaces)
+    {
+        view->cache_dirty_ns = miniwl_stats_now();
+        return false;
+    }
+
+    /* Premultiplied and cleared, so translucent parts of the tree still
+     * blend with whatever is below the view. */
+    build.image = pixman_image_create_bits(PIXMAN_a8r8g8b8, build.bounds.x2 - build.bounds.x1,
+            build.bounds.y2 - build.bounds.y1, NULL, 0);
+    if (build.image == NULL)
+    {
+        view->cache_dirty_ns = miniwl_stats_now();
+        return false;
+    }
+    view->cache = build.image;
+    wlr_surface_for_each_surface(root, cache_draw_iterator, &build);
+    if (!build.ok)
+    {
+        view_cache_invalidate(view);
+        return false;
+    }
+    server->stats.cache_builds++;
+    return true;
+}
+
+static bool view_cache_snapshot(struct miniwl_view *view, struct wlr_scene_buffer *scene_buffer, int lx, int ly, struct snapshot_data *sdata)
+{
+    /* Popups are separate trees and drawn as usual. */
+    struct wlr_scene_surface *scene_surface = wlr_scene_surface_from_buffer(scene_buffer);
+    if (scene_surface == NULL || wlr_surface_get_root_surface(scene_surface->surface) != view->xdg_surface->surface)
+    {
+        return false;
+    }
+    if (view->cache == NULL &&
+            (sdata->now_ns - view->cache_dirty_ns < MINIWL_CACHE_SETTLE_NS || !view_cache_build(view)))
+    {
+        return false;
+    }
+    struct miniwl_cache_surface *entry = NULL, **iter;
+    wl_array_for_each(iter, &view->cache_surfaces)
+    {
+        if ((*iter)->surface == scene_surface->surface)
+        {
+            entry = *iter;
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        return false;
+    }
+
+    /* The first buffer of the tree, the bottom one, stands in for all of it. */
+    if (view->cache_snapshot == sdata->seq)
+    {
+        return true;
+    }
+    view->cache_snapshot = sdata->seq;
+    int scale = (int)sdata->scene_output->output->scale;
+    if (!miniwl_render_job_add_item(&sdata->job->job, pixman_image_ref(view->cache),
+            (lx - entry->x - sdata->scene_output->x) * scale, (ly - entry->y - sdata->scene_output->y) * scale, scale))
+    {
+        pixman_image_unref(view->cache);
+        sdata->ok = false;
+    }
+    view->server->stats.cache_draws++;
+    return true;
+}
+
+static pixman_image_t *snapshot_copy(void *ptr, pixman_format_code_t format, size_t stride, const pixman_box32_t *box)
+{
+    /* Client memory is only safe to read on this thread while the buffer's
+     * access guard is held (a client shrinking its pool raises SIGBUS), so
+     * the workers get their own copy of the part they draw. */
+    int width = box->x2 - box->x1, height = box->y2 - box->y1;
+    pixman_image_t *image = pixman_image_create_bits_no_clear(format, width, height, NULL, 0);
+    if (image == NULL)
+    {
+        return NULL;
+    }
+    int bpp = PIXMAN_FORMAT_BPP(format) / 8;
+    uint8_t *dst = (uint8_t *)pixman_image_get_data(image);
+    const uint8_t *src = (const uint8_t *)ptr + (size_t)box->y1 * stride + (size_t)box->x1 * bpp;
+    for (int y = 0; y < height; y++)
+    {
+        memcpy(dst + (size_t)y * pixman_image_get_stride(image), src + (size_t)y * stride, (size_t)width * bpp);
+    }
+    return image;
+}
+
+static void snapshot_iterator(struct wlr_scene_buffer *scene_buffer, int lx, int ly, void *data)
+{
+    struct snapshot_data *sdata = data;
+    struct wlr_buffer *buffer = scene_buffer->buffer;
+    if (!sdata->ok || buffer == NULL)
+    {
+        return;
+    }
+    if (sdata->job->output->server->flatten_surfaces > 0)
+    {
+        struct wlr_scene_tree *tree = scene_buffer->node.parent;
+        while (tree != NULL && tree->node.data == NULL)
+        {
+            tree = tree->node.parent;
+        }
+        if (tree != NULL && view_cache_snapshot(tree->node.data, scene_buffer, lx, ly, sdata))
+        {
+            return;
+        }
+    }
+    /* The scene's destination size is in layout pixels and the output scale
+     * is an integer here. Buffers drawn at an integer multiple of their size
+     * go through the composite kernels; viewport crops and fractional scales
+     * are sampled by pixman with a transform, and one-pixel buffers (solid
+     * colours from single-pixel-buffer) become fills. */
+    int scale = (int)sdata->scene_output->output->scale;
+    int x = (lx - sdata->scene_output->x) * scale, y = (ly - sdata->scene_output->y) * scale;
+    int width = (scene_buffer->dst_width != 0 ? scene_buffer->dst_width : buffer->width) * scale;
+    int height = (scene_buffer->dst_height != 0 ? scene_buffer->dst_height : buffer->height) * scale;
+    int factor = width / buffer->width;
+    bool plain = wlr_fbox_empty(&scene_buffer->src_box) && factor >= 1 &&
+            width == buffer->width * factor && height == buffer->height * factor;
+    if (scene_buffer->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+    {
+        sdata->ok = false;
+        return;
+    }
+
+    /* Only what lies under this frame's damage is drawn, so that is all
+     * that needs copying; buffers outside it are skipped. */
+    pixman_region32_t visible;
+    pixman_region32_init_rect(&visible, x, y, width, height);
+    pixman_region32_intersect(&visible, &visible, &sdata->job->job.damage);
+    pixman_box32_t damage = *pixman_region32_extents(&visible);
+    bool damaged = pixman_region32_not_empty(&visible);
+    pixman_region32_fini(&visible);
+    if (!damaged)
+    {
+        return;
+    }
+
+    void *ptr;
+    uint32_t format;
+    size_t stride;
+    if (!wlr_buffer_begin_data_ptr_access(buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &ptr, &format, &stride))
+    {
+        sdata->ok = false;
+        return;
+    }
+
+    if (buffer->width == 1 && buffer->height == 1 && (format == DRM_FORMAT_ARGB8888 || format == DRM_FORMAT_XRGB8888))
+    {
+        uint32_t pixel = *(uint32_t *)ptr;
+        wlr_buffer_end_data_ptr_access(buffer);
+        if (format == DRM_FORMAT_XRGB8888)
+        {
+            pixel |= 0xff000000;
+        }
+        if (pixel >> 24 != 0 && !miniwl_render_job_add_fill(&sdata->job->job, x, y, width, height, pixel))
+        {
+            sdata->ok = false;
+        }
+        return;
+    }
+
+    /* Only the formats with a composite kernel can be scaled. */
+    pixman_format_code_t pixman_format = pixman_format_from_drm(format);
+    if (plain && factor > 1 && pixman_format != PIXMAN_a8r8g8b8 && pixman_format != PIXMAN_x8r8g8b8)
+    {
+        pixman_format = 0;
+    }
+    if (pixman_format == 0)
+    {
+        wlr_buffer_end_data_ptr_access(buffer);
+        sdata->ok = false;
+        return;
+    }
+    if (plain)
+    {
+        /* The buffer pixels under the damage, placed where they land. */
+        pixman_box32_t src = {
+                .x1 = (damage.x1 - x) / factor,
+                .y1 = (damage.y1 - y) / factor,
+                .x2 = (damage.x2 - x + factor - 1) / factor,
+                .y2 = (damage.y2 - y + factor - 1) / factor,
+        };
+        pixman_image_t *image = snapshot_copy(ptr, pixman_format, stride, &src);
+        wlr_buffer_end_data_ptr_access(buffer);
+        if (image == NULL ||
+                !miniwl_render_job_add_item(&sdata->job->job, image, x + src.x1 * factor, y + src.y1 * factor, factor))
+        {
+            if (image != NULL)
+            {
+                pixman_image_unref(image);
+            }
+            sdata->ok = false;
+        }
+        return;
+    }
+
+    /* Maps the destination box onto the viewport source, or the whole
+     * buffer without one. The copy covers the source pixels the damage
+     * samples, plus one on each side for the bilinear filter. */
+    struct wlr_fbox src = scene_buffer->src_box;
+    if (wlr_fbox_empty(&src))
+    {
+        src = (struct wlr_fbox){ .width = buffer->width, .height = buffer->height };
+    }
+    double scale_x = src.width / width, scale_y = src.height / height;
+    pixman_box32_t sampled = {
+            .x1 = (int)floor(src.x + (damage.x1 - x) * scale_x) - 1,
+            .y1 = (int)floor(src.y + (damage.y1 - y) * scale_y) - 1,
+            .x2 = (int)ceil(src.x + (damage.x2 - x) * scale_x) + 1,
+            .y2 = (int)ceil(src.y + (damage.y2 - y) * scale_y) + 1,
+    };
+    sampled.x1 = sampled.x1 > 0 ? sampled.x1 : 0;
+    sampled.y1 = sampled.y1 > 0 ? sampled.y1 : 0;
+    sampled.x2 = sampled.x2 < buffer->width ? sampled.x2 : buffer->width;
+    sampled.y2 = sampled.y2 < buffer->height ? sampled.y2 : buffer->height;
+    if (sampled.x1 >= sampled.x2 || sampled.y1 >= sampled.y2)
+    {
+        wlr_buffer_end_data_ptr_access(buffer);
+        return;
+    }
+    pixman_image_t *image = snapshot_copy(ptr, pixman_format, stride, &sampled);
+    wlr_buffer_end_data_ptr_access(buffer);
+    bool added = false;
+    if (image != NULL)
+    {
+        pixman_transform_t transform;
+        pixman_transform_init_scale(&transform, pixman_double_to_fixed(scale_x), pixman_double_to_fixed(scale_y));
+        pixman_transform_translate(&transform, NULL, pixman_double_to_fixed(src.x - sampled.x1),
+                pixman_double_to_fixed(src.y - sampled.y1));
+        pixman_image_set_transform(image, &transform);
+        pixman_image_set_filter(image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+        pixman_image_set_repeat(image, PIXMAN_REPEAT_PAD);
+        added = miniwl_render_job_add_transformed(&sdata->job->job, image, x, y, width, height);
+    }
+    if (!added)
+    {
+        if (image != NULL)
+        {
+            pixman_image_unref(image);
+        }
+        sdata->ok = false;
+    }
+}
+
+static void presentation_iterator(struct wlr_scene_buffer *scene_buffer, int lx, int ly, void *data)
+{
+    /* What the scene does for the frames it renders itself: feedback for a
+     * surface comes from its primary output, and wlroots resolves it to
+     * presented or discarded on that output's next commit. */
+    struct wlr_scene_output *scene_output = data;
+    struct miniwl_output *output = scene_output->output->data;
+    struct wlr_scene_surface *scene_surface = wlr_scene_surface_from_buffer(scene_buffer);
+    if (scene_surface != NULL && scene_buffer->primary_output == scene_output)
+    {
+        wlr_presentation_surface_sampled_on_output(output->server->presentation, scene_surface->surface,
+                scene_output->output);
+    }
+}
+
+static bool output_render_async(struct miniwl_output *output, struct wlr_scene_output *scene_output, struct miniwl_frame_sample *sample)
+{
+    /* Only the plain case is snapshotted: integer-scaled, untransformed
+     * outputs and CPU-accessible buffers. Anything else goes through the
+     * scene. */
+    struct wlr_output *wlr_output = output->wlr_output;
+    if (output->render_async_failed || wlr_output->scale < 1.0f || wlr_output->scale != floorf(wlr_output->scale) ||
+            wlr_output->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+            !pixman_region32_not_empty(&scene_output->damage_ring.current))
+    {
+        return false;
+    }
+    struct miniwl_output_buffer *target = output_acquire_buffer(output);
+    if (target == NULL)
+    {
+        return false;
+    }
+
+    struct miniwl_output_job *job = calloc(1, sizeof(struct miniwl_output_job));
+    miniwl_render_job_init(&job->job);
+    job->output = output;
+    job->target = target;
+    job->sample = sample;
+    job->job.done = output_job_done;
+    job->job.data = job;
+
+    /* The scene output's ring collects what changed since the last frame,
+     * whoever drew it; ours turns that into damage for the target's age. */
+    wlr_damage_ring_set_bounds(&output->damage_ring, wlr_output->width, wlr_output->height);
+    if (!output->render_async_last)
+    {
+        wlr_damage_ring_add_whole(&output->damage_ring);
+    }
+    wlr_damage_ring_add(&output->damage_ring, &scene_output->damage_ring.current);
+    int age = target->seq != 0 ? (int)(output->render_seq - target->seq + 1) : 0;
+    wlr_damage_ring_get_buffer_damage(&output->damage_ring, age, &job->job.damage);
+
+    struct snapshot_data sdata = {
+            .scene_output = scene_output,
+            .job = job,
+            .seq = ++output->server->snapshot_seq,
+            .now_ns = miniwl_stats_now(),
+            .ok = true,
+    };
+    wlr_scene_output_for_each_buffer(scene_output, snapshot_iterator, &sdata);
+
+    void *ptr;
+    uint32_t format;
+    size_t stride;
+    if (sdata.ok && wlr_buffer_begin_data_ptr_access(target->buffer, WLR_BUFFER_DATA_PTR_ACCESS_WRITE, &ptr, &format, &stride))
+    {
+        wlr_buffer_end_data_ptr_access(target->buffer);
+        pixman_format_code_t pixman_format = pixman_format_from_drm(format);
+        if (pixman_format != 0)
+        {
+            job->job.target = pixman_image_create_bits_no_clear(pixman_format,
+                    target->buffer->width, target->buffer->height, ptr, stride);
+        }
+    }
+    if (job->job.target == NULL)
+    {
+        output_job_destroy(job);
+        return false;
+    }
+
+    /* The snapshot is this frame's content, so its damage is consumed now;
+     * anything arriving while the workers render lands in the next frame.
+     * The scene's ring only loses its pending damage, its history is left
+     * to the scene's own buffers. */
+    wlr_damage_ring_rotate(&output->damage_ring);
+    pixman_region32_clear(&scene_output->damage_ring.current);
+    wlr_scene_output_for_each_buffer(scene_output, presentation_iterator, scene_output);
+    target->seq = ++output->render_seq;
+    output->render_async_last = true;
+
+    wlr_buffer_lock(target->buffer);
+    target->busy = true;
+    output->job = job;
+    miniwl_render_pool_submit(&output->server->render_pool, &job->job);
+    return true;
+}
+
+static void output_job_done(struct miniwl_render_job *render_job, void *data)
+{
+    struct miniwl_output_job *job = data;
+    struct miniwl_output *output = job->output;
+    struct wlr_output *wlr_output = output->wlr_output;
+    struct wlr_buffer *buffer = job->target->buffer;
+    struct wlr_scene_output *scene_output = wlr_scene_get_scene_output(output->server->scene, wlr_output);
+    miniwl_stats_wakeup(&output->server->stats, miniwl_stats_now());
+    output->job = NULL;
+
+    /* Software cursors are drawn on top here, through the output's renderer. */
+    if (wlr_renderer_begin_with_buffer(output->server->renderer, buffer))
     {
-        return ;
+        wlr_output_render_software_cursors(wlr_output, &render_job->damage);
+        wlr_renderer_end(output->server->renderer);
     }
-    if (prev_surface)
+
+    wlr_output_attach_buffer(wlr_output, buffer);
+    wlr_output_set_damage(wlr_output, &render_job->damage);
+    output->frame_sample = job->sample;
+    if (!wlr_output_commit(wlr_output))
     {
-        struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(seat->keyboard_state.focused_surface);
-        wlr_xdg_toplevel_set_activated(previous->toplevel, false);
+        wlr_log(WLR_ERROR, "Parallel render commit failed on %s, using the scene renderer", wlr_output->name);
+        output->render_async_failed = true;
+        wlr_damage_ring_add(&scene_output->damage_ring, &render_job->damage);
+        output->frame_pending = true;
     }
-    struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
+    output->frame_sample = NULL;
+    wlr_buffer_unlock(buffer);
 
-    wl_list_remove(&view->link);
-    wl_list_insert(&server->views, &view->link);
-    wlr_xdg_toplevel_set_activated(view->xdg_surface->toplevel, true);
-    wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface, keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+    struct miniwl_frame_sample *sample = job->sample;
+    output_job_destroy(job);
+    output_frame_done(output, scene_output, sample);
+    if (output->frame_pending)
+    {
+        output->frame_pending = false;
+        wlr_output_schedule_frame(wlr_output);
+    }
 }
 
-static void xdg_surface_map(struct wl_listener *listener, void *data)
+static void output_job_destroy(struct miniwl_output_job *job)
 {
-    struct miniwl_view *view = wl_container_of(listener, view, map);
-    view->mapped = true;
-    focus_view(view, view->xdg_surface->surface);
+    miniwl_render_job_finish(&job->job);
+    free(job);
 }
 
-static void xdg_surface_unmap(struct wl_listener *listener, void *data)
+static void output_precommit(struct wl_listener *listener, void *data)
 {
-    struct miniwl_view *view = wl_container_of(listener, view, unmap);
-    view->mapped = false;
+    struct miniwl_output *output = wl_container_of(listener, output, precommit);
+    struct wlr_output_event_precommit *event = data;
+    if (output->frame_sample != NULL)
+    {
+        output->frame_sample->render_end_ns = miniwl_stats_now();
+        output->frame_sample->committed = true;
+        output->frame_sample->scanout = output->scanout_buffer != NULL &&
+                (event->state->committed & WLR_OUTPUT_STATE_BUFFER) &&
+                event->state->buffer == output->scanout_buffer;
+        output->present_sample = output->frame_sample;
+        output->present_seq = output->wlr_output->commit_seq + 1;
+    }
 }
 
-static void xdg_surface_destroy(struct wl_listener *listener, void *data)
+static void output_present(struct wl_listener *listener, void *data)
 {
-    struct miniwl_view *view = wl_container_of(listener, view, destroy);
-    wl_list_remove(&view->link);
-    free(view);
+    struct miniwl_output *output = wl_container_of(listener, output, present);
+    struct wlr_output_event_present *event = data;
+    struct miniwl_frame_sample *sample = NULL;
+    if (output->present_sample != NULL && event->commit_seq == output->present_seq)
+    {
+        sample = output->present_sample;
+        output->present_sample = NULL;
+    }
+    if (!event->presented || event->when == NULL)
+    {
+        if (sample != NULL)
+        {
+            output->stats.discarded++;
+        }
+        return;
+    }
+    output->last_present_ns = (uint64_t)event->when->tv_sec * 1000000000 + event->when->tv_nsec;
+    if (event->refresh > 0)
+    {
+        output->refresh_ns = event->refresh;
+    }
+    else if (output->wlr_output->refresh > 0)
+    {
+        output->refresh_ns = 1000000000000ull / output->wlr_output->refresh;
+    }
+    if (sample != NULL)
+    {
+        sample->present_ns = output->last_present_ns;
+        if (sample->commit_end_ns != 0)
+        {
+            miniwl_output_stats_present(&output->stats, sample, output->refresh_ns);
+        }
+    }
+
+    /* Anything later than half a refresh past the vblank we aimed for went
+     * out on the one after. */
+    if (output->deadline_ns != 0 && output->last_present_ns > output->deadline_ns + output->refresh_ns / 2)
+    {
+        output->stats.deadline_misses++;
+    }
+    output->deadline_ns = 0;
 }
 
-static void output_frame(struct wl_listener *listener, void *data)
+static void output_destroy(struct wl_listener *listener, void *data)
 {
-    struct miniwl_output *output = wl_container_of(listener, output, frame);
-    struct wlr_renderer *renderer = output->server->renderer;
-
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-
-    if (!wlr_output_attach_render(output->wlr_output, NULL))
+    struct miniwl_output *output = wl_container_of(listener, output, destroy);
+    if (output->job != NULL)
     {
-        return;
+        miniwl_render_pool_wait(&output->server->render_pool, &output->job->job);
+        wlr_buffer_unlock(output->job->target->buffer);
+        output_job_destroy(output->job);
     }
-    int width, height;
-    wlr_output_effective_resolution(output->wlr_output, &width, &height);
-    wlr_renderer_begin(renderer, width, height);
-
-    float color[4] = {0.3, 0.3, 0.3, 1.0};
-    wlr_renderer_clear(renderer, color);
-    struct miniwl_view *view;
-    wl_list_for_each_reverse(view, &output->server->views, link)
+    for (int i = 0; i < MINIWL_RENDER_BUFFERS; i++)
     {
-        if (!view->mapped)
+        if (output->buffers[i].buffer != NULL)
         {
-            continue;
+            output_buffer_drop(&output->buffers[i]);
         }
-        struct render_data rdata = {
-                .output = output->wlr_output,
-                .view = view,
-                .renderer = renderer,
-                .when = &now,
-        };
-        wlr_xdg_surface_for_each_surface(view->xdg_surface, render_surface, &rdata);
     }
-
-    wlr_output_render_software_cursors(output->wlr_output, NULL);
-    wlr_renderer_end(renderer);
-    wlr_output_commit(output->wlr_output);
+    wlr_damage_ring_finish(&output->damage_ring);
+    miniwl_stats_remove_output(&output->stats);
+    wl_event_source_remove(output->render_timer);
+    wl_event_source_remove(output->budget_timer);
+    wl_list_remove(&output->frame.link);
+    wl_list_remove(&output->precommit.link);
+    wl_list_remove(&output->present.link);
+    wl_list_remove(&output->destroy.link);
+    wl_list_remove(&output->link);
+    free(output);
 }
 
 static void server_new_xdg_surface(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, new_xdg_surface);
     struct wlr_xdg_surface *xdg_surface = data;
+    if (xdg_surface->role == WLR_XDG_SURFACE_ROLE_POPUP)
+    {
+        struct wlr_xdg_surface *parent = wlr_xdg_surface_from_wlr_surface(xdg_surface->popup->parent);
+        struct wlr_scene_tree *parent_tree = parent->data;
+        xdg_surface->data = wlr_scene_xdg_surface_create(parent_tree, xdg_surface);
+
+        struct wlr_scene_tree *tree = parent_tree;
+        while (tree != NULL && tree->node.data == NULL)
+        {
+            tree = tree->node.parent;
+        }
+        if (tree == NULL)
+        {
+            return ;
+        }
+        struct miniwl_popup *popup = calloc(1, sizeof(struct miniwl_popup));
+        popup->view = tree->node.data;
+        if (popup->view->popup_count++ == 0)
+        {
+            wl_list_insert(&popup->view->workspace->grid_overflow, &popup->view->overflow_link);
+        }
+        popup->destroy.notify = xdg_popup_destroy;
+        wl_signal_add(&xdg_surface->events.destroy, &popup->destroy);
+        return ;
+    }
     if (xdg_surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL)
     {
         return ;
@@ -424,17 +2395,108 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data)
 
     struct miniwl_view *view = calloc(1, sizeof(struct miniwl_view));
     view->server = server;
+    view->workspace = server->workspace;
     view->xdg_surface = xdg_surface;
+    wl_array_init(&view->cache_surfaces);
+    pixman_region32_init(&view->opaque);
+    /* The xdg scene tree toggles itself on map and unmap; the view's own tree
+     * above it is what occlusion culling enables and disables. */
+    view->scene_tree = wlr_scene_tree_create(view->workspace->tree);
+    view->scene_tree->node.data = view;
+    xdg_surface->data = wlr_scene_xdg_surface_create(view->scene_tree, xdg_surface);
+    view->stack = ++view->workspace->stack_top;
+    view->id = ++server->next_view_id;
+    miniwl_stats_add_view(&server->stats, &view->stats, view->id);
+    miniwl_trace_event(&server->trace, "toplevel %u", view->id);
 
     view->map.notify = xdg_surface_map;
+    wl_signal_add(&xdg_surface->events.map, &view->map);
+    view->unmap.notify = xdg_surface_unmap;
+    wl_signal_add(&xdg_surface->events.unmap, &view->unmap);
+    view->destroy.notify = xdg_surface_destroy;
+    wl_signal_add(&xdg_surface->events.destroy, &view->destroy);
+    view->commit.notify = xdg_surface_commit;
+    wl_signal_add(&xdg_surface->surface->events.commit, &view->commit);
+    view->request_fullscreen.notify = xdg_toplevel_request_fullscreen;
+    wl_signal_add(&xdg_surface->toplevel->events.request_fullscreen, &view->request_fullscreen);
+    view->request_move.notify = xdg_toplevel_request_move;
+    wl_signal_add(&xdg_surface->toplevel->events.request_move, &view->request_move);
+    view->request_resize.notify = xdg_toplevel_request_resize;
+    wl_signal_add(&xdg_surface->toplevel->events.request_resize, &view->request_resize);
+    wl_list_insert(&view->workspace->views, &view->link);
 }
 
 static void server_cursor_motion(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, cursor_motion);
     struct wlr_pointer_motion_event *event = data;
-    wlr_cursor_move(server->cursor, &event->pointer->base, event->delta_x, event->delta_y);
-    process_cursor_motion(server, event->time_msec);
+    uint64_t start = miniwl_stats_now();
+    miniwl_trace_event(&server->trace, "motion %.3f %.3f", event->delta_x, event->delta_y);
+    wlr_relative_pointer_manager_v1_send_relative_motion(server->relative_pointer_mgr, server->seat,
+            (uint64_t)event->time_msec * 1000, event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy);
+
+    /* A locked pointer only produces the relative events above: the cursor
+     * stays put and hidden, so there is nothing to hit test or draw. */
+    struct wlr_pointer_constraint_v1 *constraint = server->active_constraint;
+    if (constraint != NULL && constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED)
+    {
+        miniwl_stats_record_input(&server->stats, MINIWL_INPUT_MOTION, start);
+        return;
+    }
+    double dx = event->delta_x, dy = event->delta_y;
+    double sx, sy;
+    if (constraint != NULL && server_pointer_constraint(server, &sx, &sy) == constraint)
+    {
+        double cx, cy;
+        if (wlr_region_confine(&constraint->region, sx, sy, sx + dx, sy + dy, &cx, &cy))
+        {
+            dx = cx - sx;
+            dy = cy - sy;
+        }
+    }
+    wlr_cursor_move(server->cursor, &event->pointer->base, dx, dy);
+    server_handle_motion(server, event->time_msec);
+    miniwl_stats_record_input(&server->stats, MINIWL_INPUT_MOTION, start);
+}
+
+static void server_handle_motion(struct miniwl_server *server, uint32_t time)
+{
+    /* With coalescing on, the cursor itself still moves at full rate but the
+     * hit test and wl_pointer.motion happen once per output frame. While a
+     * button is held, during an interactive move/resize, or while confined
+     * (which clamps against the last delivered position), every event is
+     * delivered. */
+    if (!server->coalesce_motion || server->cursor_mode != MINIWL_CURSOR_PASSTHROUGH ||
+            server->seat->pointer_state.button_count > 0 || server->active_constraint != NULL)
+    {
+        process_cursor_motion(server, time);
+        return;
+    }
+
+    server->motion_time = time;
+    if (server->motion_pending)
+    {
+        return;
+    }
+    struct wlr_output *output = wlr_output_layout_output_at(server->output_layout, server->cursor->x, server->cursor->y);
+    if (output == NULL || !output->enabled)
+    {
+        process_cursor_motion(server, time);
+        return;
+    }
+    server->motion_pending = true;
+    wlr_output_schedule_frame(output);
+}
+
+static void server_flush_motion(struct miniwl_server *server)
+{
+    if (!server->motion_pending)
+    {
+        return;
+    }
+    server->motion_pending = false;
+    process_cursor_motion(server, server->motion_time);
+    wlr_seat_pointer_notify_frame(server->seat);
 }
 
 static void process_cursor_motion(struct miniwl_server *server, uint32_t time)
@@ -457,7 +2519,7 @@ static void process_cursor_motion(struct miniwl_server *server, uint32_t time)
 
     if (!view)
     {
-        wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, "left_ptr", server->cursor);
+        server_set_cursor_image(server, "left_ptr");
     }
 
     if (surface)
@@ -469,12 +2531,12 @@ static void process_cursor_motion(struct miniwl_server *server, uint32_t time)
     {
         wlr_seat_pointer_clear_focus(seat);
     }
+    server_update_constraint(server);
 }
 
 static void process_cursor_move(struct miniwl_server *server, uint32_t time)
 {
-    server->grabbed_view->x = server->cursor->x - server->grab_x;
-    server->grabbed_view->y = server->cursor->y - server->grab_y;
+    view_set_position(server->grabbed_view, server->cursor->x - server->grab_x, server->cursor->y - server->grab_y);
 }
 
 static void process_cursor_resize(struct miniwl_server *server, uint32_t time)
@@ -494,54 +2556,63 @@ static void process_cursor_resize(struct miniwl_server *server, uint32_t time)
         {
             new_top = new_bottom - 1;
         }
-        else if (server->resize_edges & WLR_EDGE_BOTTOM)
+    }
+    else if (server->resize_edges & WLR_EDGE_BOTTOM)
+    {
+        new_bottom = border_y;
+        if (new_bottom <= new_top)
         {
-            new_bottom = border_y;
-            if (new_bottom <= new_top)
-            {
-                new_bottom = new_top + 1;
-            }
+            new_bottom = new_top + 1;
         }
-        if (server->resize_edges & WLR_EDGE_LEFT)
+    }
+    if (server->resize_edges & WLR_EDGE_LEFT)
+    {
+        new_left = border_x;
+        if (new_left >= new_right)
         {
-            new_left = border_x;
-            if (new_left >= new_left)
-            {
-                new_left = new_right + 1;
-            }
+            new_left = new_right - 1;
         }
-        else if (server->resize_edges & WLR_EDGE_RIGHT)
+    }
+    else if (server->resize_edges & WLR_EDGE_RIGHT)
+    {
+        new_right = border_x;
+        if (new_right <= new_left)
         {
-            new_right = border_x;
-            if (new_right <= new_left)
-            {
-                new_right = new_left + 1;
-            }
+            new_right = new_left + 1;
         }
-
-        struct wlr_box geo_box;
-        wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
-        view->x = new_left - geo_box.x;
-        view->y = new_top - geo_box.y;
-
-        int new_width = new_right;
-        int new_height = new_bottom - new_top;
-        wlr_xdg_toplevel_set_size(view->xdg_surface->toplevel, new_width, new_height);
     }
+
+    struct wlr_box box = {
+            .x = new_left,
+            .y = new_top,
+            .width = new_right - new_left,
+            .height = new_bottom - new_top,
+    };
+    view_resize(view, &box, server->resize_edges);
 }
 
 static void server_cursor_motion_absolute(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, cursor_motion_absolute);
     struct wlr_pointer_motion_absolute_event *event = data;
+    uint64_t start = miniwl_stats_now();
+    miniwl_trace_event(&server->trace, "motion_absolute %.5f %.5f", event->x, event->y);
+    if (server->active_constraint != NULL && server->active_constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED)
+    {
+        miniwl_stats_record_input(&server->stats, MINIWL_INPUT_MOTION, start);
+        return;
+    }
     wlr_cursor_warp_absolute(server->cursor, &event->pointer->base, event->x, event->y);
-    process_cursor_motion(server, event->time_msec);
+    server_handle_motion(server, event->time_msec);
+    miniwl_stats_record_input(&server->stats, MINIWL_INPUT_MOTION, start);
 }
 
 static void server_cursor_button(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, cursor_button);
     struct wlr_pointer_button_event *event = data;
+    miniwl_trace_event(&server->trace, "button %u %d", event->button, event->state == WLR_BUTTON_PRESSED);
+    server_flush_motion(server);
     wlr_seat_pointer_notify_button(server->seat, event->time_msec, event->button, event->state);
     double sx, sy;
     struct wlr_surface *surface;
@@ -549,7 +2620,7 @@ static void server_cursor_button(struct wl_listener *listener, void *data)
 
     if (event->state == WLR_BUTTON_RELEASED)
     {
-        server->cursor_mode = MINIWL_CURSOR_PASSTHROUGH;
+        server_end_interactive(server);
     }
     else
     {
@@ -561,12 +2632,18 @@ static void server_cursor_axis(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, cursor_axis);
     struct wlr_pointer_axis_event *event = data;
+    miniwl_trace_event(&server->trace, "axis %d %.3f %d", event->orientation, event->delta, event->delta_discrete);
+    server_flush_motion(server);
     wlr_seat_pointer_notify_axis(server->seat, event->time_msec, event->orientation, event->delta, event->delta_discrete, event->source);
 }
 
 static void server_cursor_frame(struct wl_listener *listener, void *data)
 {
     struct miniwl_server *server = wl_container_of(listener, server, cursor_frame);
+    if (server->motion_pending)
+    {
+        return;
+    }
     wlr_seat_pointer_notify_frame(server->seat);
 }
 
@@ -575,10 +2652,26 @@ static void seat_request_cursor(struct wl_listener *listener, void *data)
     struct miniwl_server *server = wl_container_of(listener, server, request_cursor);
     struct wlr_seat_pointer_request_set_cursor_event *event = data;
     struct wlr_seat_client *focused_client = server->seat->pointer_state.focused_client;
-    if (focused_client == event->seat_client)
+    bool locked = server->active_constraint != NULL &&
+            server->active_constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED;
+    if (focused_client == event->seat_client && !locked)
     {
         wlr_cursor_set_surface(server->cursor, event->surface, event->hotspot_x, event->hotspot_y);
+        server->cursor_image = NULL;
+    }
+}
+
+static void server_set_cursor_image(struct miniwl_server *server, const char *name)
+{
+    /* Setting an image re-uploads it to every output's cursor plane (or
+     * damages the software cursor), so only do it when it changes; plain
+     * motion then only moves the plane. */
+    if (server->cursor_image != NULL && strcmp(server->cursor_image, name) == 0)
+    {
+        return ;
     }
+    server->cursor_image = name;
+    wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, name, server->cursor);
 }
 
 static void seat_request_set_selection(struct wl_listener *listener, void *data)
@@ -588,46 +2681,414 @@ static void seat_request_set_selection(struct wl_listener *listener, void *data)
     wlr_seat_set_selection(server->seat, event->source, event->serial);
 }
 
+static void server_new_pointer_constraint(struct wl_listener *listener, void *data)
+{
+    struct miniwl_server *server = wl_container_of(listener, server, new_pointer_constraint);
+    struct wlr_pointer_constraint_v1 *wlr_constraint = data;
+    struct miniwl_pointer_constraint *constraint = calloc(1, sizeof(struct miniwl_pointer_constraint));
+    if (constraint == NULL)
+    {
+        return;
+    }
+    constraint->server = server;
+    constraint->constraint = wlr_constraint;
+    constraint->set_region.notify = pointer_constraint_set_region;
+    wl_signal_add(&wlr_constraint->events.set_region, &constraint->set_region);
+    constraint->destroy.notify = pointer_constraint_destroy;
+    wl_signal_add(&wlr_constraint->events.destroy, &constraint->destroy);
+    server_update_constraint(server);
+}
+
+static void pointer_constraint_set_region(struct wl_listener *listener, void *data)
+{
+    struct miniwl_pointer_constraint *constraint = wl_container_of(listener, constraint, set_region);
+    struct miniwl_server *server = constraint->server;
+    struct wlr_pointer_constraint_v1 *wlr_constraint = constraint->constraint;
+    double sx, sy;
+    if (server->active_constraint == wlr_constraint && wlr_constraint->type == WLR_POINTER_CONSTRAINT_V1_CONFINED &&
+            server_pointer_constraint(server, &sx, &sy) == wlr_constraint &&
+            !pixman_region32_contains_point(&wlr_constraint->region, floor(sx), floor(sy), NULL))
+    {
+        /* The new region no longer holds the pointer: let go, and confine
+         * again once it moves back in. Destroys a oneshot constraint, and
+         * constraint with it. */
+        server->active_constraint = NULL;
+        wlr_pointer_constraint_v1_send_deactivated(wlr_constraint);
+        return;
+    }
+    server_update_constraint(server);
+}
+
+static void pointer_constraint_destroy(struct wl_listener *listener, void *data)
+{
+    struct miniwl_pointer_constraint *constraint = wl_container_of(listener, constraint, destroy);
+    struct miniwl_server *server = constraint->server;
+    if (server->active_constraint == constraint->constraint)
+    {
+        server->active_constraint = NULL;
+        server_unlock_cursor(server, constraint->constraint);
+    }
+    wl_list_remove(&constraint->set_region.link);
+    wl_list_remove(&constraint->destroy.link);
+    free(constraint);
+}
+
+static struct wlr_pointer_constraint_v1 *server_pointer_constraint(struct miniwl_server *server, double *sx, double *sy)
+{
+    /* The constraint may sit on a parent of the subsurface under the
+     * pointer; its region is in that parent's coordinates. */
+    struct wlr_seat *seat = server->seat;
+    struct wlr_surface *surface = seat->pointer_state.focused_surface;
+    *sx = seat->pointer_state.sx;
+    *sy = seat->pointer_state.sy;
+    while (surface != NULL)
+    {
+        struct wlr_pointer_constraint_v1 *constraint =
+                wlr_pointer_constraints_v1_constraint_for_surface(server->pointer_constraints, surface, seat);
+        if (constraint != NULL || !wlr_surface_is_subsurface(surface))
+        {
+            return constraint;
+        }
+        struct wlr_subsurface *subsurface = wlr_subsurface_from_wlr_surface(surface);
+        *sx += subsurface->current.x;
+        *sy += subsurface->current.y;
+        surface = subsurface->parent;
+    }
+    return NULL;
+}
+
+static void server_update_constraint(struct miniwl_server *server)
+{
+    /* A constraint is active while its surface has both pointer and
+     * keyboard focus; it only activates with the pointer inside its region. */
+    struct wlr_seat *seat = server->seat;
+    struct wlr_surface *surface = seat->pointer_state.focused_surface;
+    struct wlr_pointer_constraint_v1 *constraint = NULL;
+    double sx = 0, sy = 0;
+    if (surface != NULL && wlr_surface_get_root_surface(surface) == seat->keyboard_state.focused_surface)
+    {
+        constraint = server_pointer_constraint(server, &sx, &sy);
+    }
+    if (constraint == server->active_constraint)
+    {
+        return;
+    }
+    if (constraint != NULL && !pixman_region32_contains_point(&constraint->region, floor(sx), floor(sy), NULL))
+    {
+        constraint = NULL;
+    }
+
+    struct wlr_pointer_constraint_v1 *previous = server->active_constraint;
+    server->active_constraint = constraint;
+    if (previous != NULL)
+    {
+        server_unlock_cursor(server, previous);
+        /* Destroys a oneshot constraint, so it goes last. */
+        wlr_pointer_constraint_v1_send_deactivated(previous);
+    }
+    if (constraint == NULL)
+    {
+        return;
+    }
+    server->constraint_x = server->cursor->x - sx;
+    server->constraint_y = server->cursor->y - sy;
+    if (constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED)
+    {
+        wlr_cursor_set_surface(server->cursor, NULL, 0, 0);
+        server->cursor_image = NULL;
+    }
+    wlr_pointer_constraint_v1_send_activated(constraint);
+}
+
+static void server_unlock_cursor(struct miniwl_server *server, struct wlr_pointer_constraint_v1 *constraint)
+{
+    if (constraint->type != WLR_POINTER_CONSTRAINT_V1_LOCKED)
+    {
+        return;
+    }
+    if (constraint->current.committed & WLR_POINTER_CONSTRAINT_V1_STATE_CURSOR_HINT)
+    {
+        wlr_cursor_warp(server->cursor, NULL, server->constraint_x + constraint->current.cursor_hint.x,
+                server->constraint_y + constraint->current.cursor_hint.y);
+    }
+    server_set_cursor_image(server, "left_ptr");
+}
+
+static void server_set_scheduling(int policy, int priority, int cpu)
+{
+    /* Both only apply to the calling thread, so the render workers started
+     * earlier keep the default policy and may run on any CPU. */
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        {
+            wlr_log_errno(WLR_ERROR, "Failed to pin the compositor thread to CPU %d", cpu);
+        }
+    }
+    if (policy != SCHED_OTHER)
+    {
+        struct sched_param param = { .sched_priority = priority };
+        if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) < 0)
+        {
+            wlr_log_errno(WLR_ERROR, "Failed to set %s priority %d", policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR",
+                    priority);
+        }
+    }
+}
+
+static int server_dispatch_clients(int fd, uint32_t mask, void *data)
+{
+    struct miniwl_server *server = data;
+    if (mask != 0)
+    {
+        /* Woken by a client; it is dispatched in the check below, once the
+         * backend sources of this pass have run. */
+        miniwl_stats_wakeup(&server->stats, miniwl_stats_now());
+        return 0;
+    }
+
+    /* The first source of the pass to run noted the wakeup; wl_display_run
+     * does the waiting. */
+    struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+    uint64_t start = miniwl_stats_now();
+    if (server->stats.wakeup_ns != 0)
+    {
+        miniwl_histogram_add(&server->stats.dispatch[MINIWL_DISPATCH_BACKEND], start - server->stats.wakeup_ns);
+    }
+    wl_event_loop_dispatch_idle(wl_display_get_event_loop(server->backend_display));
+    wl_event_loop_dispatch(loop, 0);
+    wl_display_flush_clients(server->wl_display);
+    miniwl_histogram_add(&server->stats.dispatch[MINIWL_DISPATCH_CLIENTS], miniwl_stats_now() - start);
+    server->stats.wakeup_ns = 0;
+    return 0;
+}
+
+static void server_run(struct miniwl_server *server)
+{
+    if (server->backend_display == server->wl_display)
+    {
+        wl_display_run(server->wl_display);
+        return ;
+    }
+
+    /* -P: the backend's display runs the loop, so it stops when wlroots
+     * terminates it; server_terminate stops both. The client loop is a
+     * source on it, dispatched from the post-dispatch check, i.e. after
+     * input, output frames and render completions of the same wakeup, so a
+     * client flooding its socket cannot hold input back. */
+    struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+    struct wl_event_loop *backend_loop = wl_display_get_event_loop(server->backend_display);
+    struct wl_event_source *source = wl_event_loop_add_fd(backend_loop, wl_event_loop_get_fd(loop),
+            WL_EVENT_READABLE, server_dispatch_clients, server);
+    wl_event_source_check(source);
+    server->stats.track_wakeup = true;
+    wl_display_run(server->backend_display);
+    server->stats.track_wakeup = false;
+    wl_event_source_remove(source);
+    server->stats.wakeup_ns = 0;
+}
+
+static void server_terminate(struct miniwl_server *server)
+{
+    wl_display_terminate(server->wl_display);
+    if (server->backend_display != server->wl_display)
+    {
+        wl_display_terminate(server->backend_display);
+    }
+}
+
+static void print_usage(const char *argv0)
+{
+    printf("Usage: %s [-s startup command] [-S stats socket] [-m] [-j render threads] [-l latch margin ms] "
+            "[-R trace file] [-b unfocused fps] [-F flatten surfaces] [-P] [-r fifo|rr:priority] [-c cpu] "
+            "[-v silent|error|info|debug] [-B binary log] [-I]\n", argv0);
+}
+
 int main(int argc, char *argv[])
 {
-    wlr_log_init(WLR_DEBUG, NULL);
+    static const char *verbosity_names[] = {
+            [WLR_SILENT] = "silent",
+            [WLR_ERROR] = "error",
+            [WLR_INFO] = "info",
+            [WLR_DEBUG] = "debug",
+    };
+    int verbosity = WLR_INFO;
+    char *binlog_path = NULL;
     char *startup_cmd = NULL;
+    char *stats_path = NULL;
+    bool coalesce_motion = false;
+    int render_threads = 0;
+    int latch_margin_ms = -1;
+    char *trace_path = NULL;
+    double unfocused_fps = -1;
+    int flatten_surfaces = 0;
+    bool input_priority = false;
+    int sched_policy = SCHED_OTHER;
+    int sched_priority = 0;
+    int cpu = -1;
+    bool virtual_input = false;
 
     int c;
-    while ((c = getopt(argc, argv, "s:h")) != -1)
+    while ((c = getopt(argc, argv, "s:S:mj:l:R:b:F:Pr:c:v:B:Ih")) != -1)
     {
         switch (c)
         {
             case 's':
                 startup_cmd = optarg;
                 break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'm':
+                coalesce_motion = true;
+                break;
+            case 'j':
+                render_threads = atoi(optarg);
+                break;
+            case 'l':
+                latch_margin_ms = atoi(optarg);
+                break;
+            case 'R':
+                trace_path = optarg;
+                break;
+            case 'b':
+                unfocused_fps = atof(optarg);
+                break;
+            case 'F':
+                flatten_surfaces = atoi(optarg);
+                break;
+            case 'P':
+#if !MINIWL_INPUT_PRIORITY
+                fprintf(stderr, "-P needs wlroots 0.16, miniwl was built against %s\n", WLR_VERSION_STR);
+                return 1;
+#endif
+                input_priority = true;
+                break;
+            case 'r':
+                if (strncmp(optarg, "fifo:", 5) == 0)
+                {
+                    sched_policy = SCHED_FIFO;
+                    sched_priority = atoi(optarg + 5);
+                }
+                else if (strncmp(optarg, "rr:", 3) == 0)
+                {
+                    sched_policy = SCHED_RR;
+                    sched_priority = atoi(optarg + 3);
+                }
+                else
+                {
+                    print_usage(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            case 'v':
+                verbosity = -1;
+                for (int i = 0; i < WLR_LOG_IMPORTANCE_LAST; i++)
+                {
+                    if (strcmp(optarg, verbosity_names[i]) == 0)
+                    {
+                        verbosity = i;
+                    }
+                }
+                if (verbosity < 0)
+                {
+                    print_usage(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'B':
+                binlog_path = optarg;
+                break;
+            case 'I':
+                virtual_input = true;
+                break;
             default:
-                printf("Usage: %s [-s startup command]\n", argv[0]);
+                print_usage(argv[0]);
                 return 0;
         }
     }
 
     if (optind < argc)
     {
-        printf("Usage: %s [-s startup command]\n", argv[0]);
+        print_usage(argv[0]);
         return 0;
     }
+    wlr_log_init(verbosity, NULL);
+    if (binlog_path != NULL && !miniwl_binlog_open(binlog_path, verbosity))
+    {
+        return 1;
+    }
 
-    struct miniwl_server server;
+    struct miniwl_server server = {0};
+    server.coalesce_motion = coalesce_motion;
+    server.flatten_surfaces = flatten_surfaces;
+    server.late_latch = latch_margin_ms >= 0;
+    server.latch_margin_ns = latch_margin_ms >= 0 ? (uint64_t)latch_margin_ms * 1000000 : 0;
+    if (unfocused_fps >= 0)
+    {
+        server.unfocused_frame_ns = unfocused_fps > 0 ? (uint64_t)(1e9 / unfocused_fps) : UINT64_MAX;
+    }
     server.wl_display = wl_display_create();
-    server.backend = wlr_backend_autocreate(server.wl_display);
+    server.backend_display = input_priority ? wl_display_create() : server.wl_display;
+    miniwl_stats_init(&server.stats, wl_display_get_event_loop(server.wl_display));
+    if (trace_path != NULL && !miniwl_trace_open(&server.trace, trace_path))
+    {
+        wl_display_destroy(server.wl_display);
+        return 1;
+    }
+    if (render_threads > 0 &&
+            !miniwl_render_pool_init(&server.render_pool, wl_display_get_event_loop(server.backend_display), render_threads))
+    {
+        wlr_log(WLR_ERROR, "Failed to start render threads, rendering on the main thread");
+    }
+    if (flatten_surfaces > 0 && server.render_pool.nthreads == 0)
+    {
+        wlr_log(WLR_INFO, "Surface trees are only flattened when rendering with -j");
+    }
+    server.backend = wlr_backend_autocreate(server.backend_display);
     server.renderer = wlr_renderer_autocreate(server.backend);
     wlr_renderer_init_wl_display(server.renderer, server.wl_display);
+    server.allocator = wlr_allocator_autocreate(server.backend, server.renderer);
     wlr_compositor_create(server.wl_display, server.renderer);
+    wlr_viewporter_create(server.wl_display);
+    wlr_single_pixel_buffer_manager_v1_create(server.wl_display);
     wlr_data_device_manager_create(server.wl_display);
 
     server.output_layout = wlr_output_layout_create();
+    server.scene = wlr_scene_create();
+    wlr_scene_attach_output_layout(server.scene, server.output_layout);
+    server.presentation = wlr_presentation_create(server.wl_display, server.backend);
+    wlr_scene_set_presentation(server.scene, server.presentation);
+
+    /* Both capture from the buffer each output commits, so they never cause
+     * a render of their own beyond requesting the next frame. */
+    wlr_screencopy_manager_v1_create(server.wl_display);
+    wlr_export_dmabuf_manager_v1_create(server.wl_display);
 
     wl_list_init(&server.outputs);
     server.new_output.notify = server_new_output;
     wl_signal_add(&server.backend->events.new_output, &server.new_output);
 
-    wl_list_init(&server.views);
+    for (int i = 0; i < MINIWL_WORKSPACES; i++)
+    {
+        struct miniwl_workspace *workspace = &server.workspaces[i];
+        workspace->server = &server;
+        workspace->tree = wlr_scene_tree_create(&server.scene->tree);
+        wlr_scene_node_set_enabled(&workspace->tree->node, i == 0);
+        wl_list_init(&workspace->views);
+        wl_list_init(&workspace->grid_overflow);
+        for (int j = 0; j < MINIWL_GRID_BUCKETS; j++)
+        {
+            wl_array_init(&workspace->grid[j]);
+        }
+    }
+    server.workspace = &server.workspaces[0];
     server.xdg_shell = wlr_xdg_shell_create(server.wl_display, 1);
     server.new_xdg_surface.notify = server_new_xdg_surface;
     wl_signal_add(&server.xdg_shell->events.new_surface, &server.new_xdg_surface);
@@ -643,11 +3104,13 @@ int main(int argc, char *argv[])
     server.cursor_button.notify = server_cursor_button;
     wl_signal_add(&server.cursor->events.button, &server.cursor_button);
     server.cursor_axis.notify = server_cursor_axis;
-    wl_signal_add(&server.cursor->events.frame, &server.cursor_axis);
+    wl_signal_add(&server.cursor->events.axis, &server.cursor_axis);
     server.cursor_frame.notify = server_cursor_frame;
     wl_signal_add(&server.cursor->events.frame, &server.cursor_frame);
 
     wl_list_init(&server.keyboard);
+    wl_list_init(&server.keymaps);
+    server.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
     server.new_input.notify = server_new_input;
     wl_signal_add(&server.backend->events.new_input, &server.new_input);
     server.seat = wlr_seat_create(server.wl_display, "seat0");
@@ -656,8 +3119,24 @@ int main(int argc, char *argv[])
     server.request_set_selection.notify = seat_request_set_selection;
     wl_signal_add(&server.seat->events.request_set_selection, &server.request_set_selection);
 
+    /* Virtual input lets any client type into and click on every other
+     * client, so it is only offered with -I, for the bench. */
+    if (virtual_input)
+    {
+        server.virtual_pointer_mgr = wlr_virtual_pointer_manager_v1_create(server.wl_display);
+        server.new_virtual_pointer.notify = server_new_virtual_pointer;
+        wl_signal_add(&server.virtual_pointer_mgr->events.new_virtual_pointer, &server.new_virtual_pointer);
+        server.virtual_keyboard_mgr = wlr_virtual_keyboard_manager_v1_create(server.wl_display);
+        server.new_virtual_keyboard.notify = server_new_virtual_keyboard;
+        wl_signal_add(&server.virtual_keyboard_mgr->events.new_virtual_keyboard, &server.new_virtual_keyboard);
+    }
+    server.relative_pointer_mgr = wlr_relative_pointer_manager_v1_create(server.wl_display);
+    server.pointer_constraints = wlr_pointer_constraints_v1_create(server.wl_display);
+    server.new_pointer_constraint.notify = server_new_pointer_constraint;
+    wl_signal_add(&server.pointer_constraints->events.new_constraint, &server.new_pointer_constraint);
+
     const char *socket = wl_display_add_socket_auto(server.wl_display);
-    if (socket)
+    if (!socket)
     {
         wlr_backend_destroy(server.backend);
         return 1;
@@ -671,6 +3150,20 @@ int main(int argc, char *argv[])
     }
 
     setenv("WAYLAND_DISPLAY", socket, true);
+
+    char default_stats_path[108];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (stats_path == NULL && runtime_dir != NULL)
+    {
+        snprintf(default_stats_path, sizeof(default_stats_path), "%s/miniwl-%s.stats", runtime_dir, socket);
+        stats_path = default_stats_path;
+    }
+    if (stats_path != NULL && stats_path[0] != '\0' && miniwl_stats_listen(&server.stats, stats_path))
+    {
+        setenv("MINIWL_STATS_SOCKET", stats_path, true);
+        wlr_log(WLR_INFO, "Serving stats on %s", stats_path);
+    }
+
     if (startup_cmd)
     {
         if (fork() == 0)
@@ -679,9 +3172,21 @@ int main(int argc, char *argv[])
         }
     }
 
+    server_set_scheduling(sched_policy, sched_priority, cpu);
     wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s", socket);
-    wl_display_run(server.wl_display);
+    server_run(&server);
+    miniwl_stats_finish(&server.stats);
     wl_display_destroy_clients(server.wl_display);
+    /* Outputs wait for their in-flight frames on destroy, so they have to go
+     * while the render pool is still running. */
+    wlr_backend_destroy(server.backend);
+    miniwl_render_pool_finish(&server.render_pool);
     wl_display_destroy(server.wl_display);
+    if (server.backend_display != server.wl_display)
+    {
+        wl_display_destroy(server.backend_display);
+    }
+    miniwl_trace_close(&server.trace);
+    miniwl_binlog_close();
     return 0;
 }
@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+#include "render.h"
+
+static void render_fill(struct miniwl_render_pool *pool, struct miniwl_render_job *job,
+        struct miniwl_render_item *item, pixman_box32_t *boxes, int nboxes)
+{
+    pixman_box32_t rect = { item->x, item->y, item->x + item->width, item->y + item->height };
+    if (item->color >> 24 == 0xff)
+    {
+        for (int i = 0; i < nboxes; i++)
+        {
+            pixman_box32_t box = {
+                    .x1 = boxes[i].x1 > rect.x1 ? boxes[i].x1 : rect.x1,
+                    .y1 = boxes[i].y1 > rect.y1 ? boxes[i].y1 : rect.y1,
+                    .x2 = boxes[i].x2 < rect.x2 ? boxes[i].x2 : rect.x2,
+                    .y2 = boxes[i].y2 < rect.y2 ? boxes[i].y2 : rect.y2,
+            };
+            if (box.x1 < box.x2 && box.y1 < box.y2)
+            {
+                miniwl_composite_fill(pool->composite, job->target, &box, item->color);
+            }
+        }
+        return;
+    }
+
+    pixman_region32_t region;
+    pixman_region32_init_rect(&region, rect.x1, rect.y1, item->width, item->height);
+    pixman_region32_intersect(&region, &region, &job->damage);
+    int count;
+    pixman_box32_t *fill = pixman_region32_rectangles(&region, &count);
+    pixman_color_t color = {
+            .alpha = (item->color >> 24) * 0x101,
+            .red = (item->color >> 16 & 0xff) * 0x101,
+            .green = (item->color >> 8 & 0xff) * 0x101,
+            .blue = (item->color & 0xff) * 0x101,
+    };
+    pixman_image_fill_boxes(PIXMAN_OP_OVER, job->target, &color, count, fill);
+    pixman_region32_fini(&region);
+}
+
+static void render_job_run(struct miniwl_render_pool *pool, struct miniwl_render_job *job)
+{
+    int nboxes;
+    pixman_box32_t *boxes = pixman_region32_rectangles(&job->damage, &nboxes);
+    if (nboxes == 0)
+    {
+        return;
+    }
+
+    const struct miniwl_composite_ops *ops = pool->composite;
+    for (int i = 0; i < nboxes; i++)
+    {
+        miniwl_composite_fill(ops, job->target, &boxes[i], 0xff000000);
+    }
+
+    struct miniwl_render_item *item;
+    wl_array_for_each(item, &job->items)
+    {
+        if (item->image == NULL)
+        {
+            render_fill(pool, job, item, boxes, nboxes);
+            continue;
+        }
+        if (item->scale == 0)
+        {
+            pixman_image_set_clip_region32(job->target, &job->damage);
+            pixman_op_t op = PIXMAN_FORMAT_A(pixman_image_get_format(item->image)) > 0 ? PIXMAN_OP_OVER : PIXMAN_OP_SRC;
+            pixman_image_composite32(op, item->image, NULL, job->target, 0, 0, 0, 0, item->x, item->y,
+                    item->width, item->height);
+            pixman_image_set_clip_region32(job->target, NULL);
+            continue;
+        }
+
+        bool drawn = true;
+        for (int i = 0; i < nboxes && drawn; i++)
+        {
+            drawn = miniwl_composite_blit(ops, job->target, item->image, item->x, item->y, item->scale, &boxes[i]);
+        }
+        if (drawn)
+        {
+            continue;
+        }
+
+        /* Formats without a kernel are never scaled, see the snapshot. */
+        pixman_image_set_clip_region32(job->target, &job->damage);
+        pixman_op_t op = PIXMAN_FORMAT_A(pixman_image_get_format(item->image)) > 0 ? PIXMAN_OP_OVER : PIXMAN_OP_SRC;
+        pixman_image_composite32(op, item->image, NULL, job->target, 0, 0, 0, 0, item->x, item->y,
+                pixman_image_get_width(item->image), pixman_image_get_height(item->image));
+        pixman_image_set_clip_region32(job->target, NULL);
+    }
+}
+
+static void *render_worker(void *data)
+{
+    struct miniwl_render_pool *pool = data;
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (!pool->stopping && wl_list_empty(&pool->pending))
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stopping)
+        {
+            break;
+        }
+        struct miniwl_render_job *job = wl_container_of(pool->pending.prev, job, link);
+        wl_list_remove(&job->link);
+        pthread_mutex_unlock(&pool->lock);
+
+        render_job_run(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->finished = true;
+        wl_list_insert(pool->done.prev, &job->link);
+        pthread_cond_broadcast(&pool->finished);
+        uint64_t one = 1;
+        if (write(pool->notify_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            wlr_log_errno(WLR_ERROR, "Failed to notify render completion");
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int render_pool_handle_notify(int fd, uint32_t mask, void *data)
+{
+    struct miniwl_render_pool *pool = data;
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to read render completion");
+    }
+
+    struct wl_list done;
+    wl_list_init(&done);
+    pthread_mutex_lock(&pool->lock);
+    wl_list_insert_list(&done, &pool->done);
+    wl_list_init(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+
+    struct miniwl_render_job *job, *tmp;
+    wl_list_for_each_safe(job, tmp, &done, link)
+    {
+        wl_list_remove(&job->link);
+        wl_list_init(&job->link);
+        job->done(job, job->data);
+    }
+    return 0;
+}
+
+bool miniwl_render_pool_init(struct miniwl_render_pool *pool, struct wl_event_loop *loop, int nthreads)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    wl_list_init(&pool->pending);
+    wl_list_init(&pool->done);
+    pool->stopping = false;
+    pool->nthreads = 0;
+    pool->composite = miniwl_composite_get();
+
+    pool->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pool->notify_fd < 0)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to create render eventfd");
+        return false;
+    }
+    pool->notify_source = wl_event_loop_add_fd(loop, pool->notify_fd, WL_EVENT_READABLE,
+            render_pool_handle_notify, pool);
+
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, render_worker, pool) != 0)
+        {
+            wlr_log(WLR_ERROR, "Failed to start render thread %d", i);
+            break;
+        }
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0)
+    {
+        miniwl_render_pool_finish(pool);
+        return false;
+    }
+    wlr_log(WLR_INFO, "Rendering on %d threads with %s kernels", pool->nthreads, pool->composite->name);
+    return true;
+}
+
+void miniwl_render_pool_finish(struct miniwl_render_pool *pool)
+{
+    if (pool->threads == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nthreads = 0;
+
+    wl_event_source_remove(pool->notify_source);
+    close(pool->notify_fd);
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void miniwl_render_job_init(struct miniwl_render_job *job)
+{
+    wl_list_init(&job->link);
+    job->target = NULL;
+    pixman_region32_init(&job->damage);
+    wl_array_init(&job->items);
+    job->finished = false;
+}
+
+void miniwl_render_job_finish(struct miniwl_render_job *job)
+{
+    struct miniwl_render_item *item;
+    wl_array_for_each(item, &job->items)
+    {
+        if (item->image != NULL)
+        {
+            pixman_image_unref(item->image);
+        }
+    }
+    wl_array_release(&job->items);
+    pixman_region32_fini(&job->damage);
+    if (job->target != NULL)
+    {
+        pixman_image_unref(job->target);
+    }
+}
+
+bool miniwl_render_job_add_item(struct miniwl_render_job *job, pixman_image_t *image, int x, int y, int scale)
+{
+    struct miniwl_render_item *item = wl_array_add(&job->items, sizeof(*item));
+    if (item == NULL)
+    {
+        return false;
+    }
+    *item = (struct miniwl_render_item){
+            .image = image,
+            .x = x,
+            .y = y,
+            .scale = scale,
+    };
+    return true;
+}
+
+bool miniwl_render_job_add_transformed(struct miniwl_render_job *job, pixman_image_t *image,
+        int x, int y, int width, int height)
+{
+    struct miniwl_render_item *item = wl_array_add(&job->items, sizeof(*item));
+    if (item == NULL)
+    {
+        return false;
+    }
+    *item = (struct miniwl_render_item){
+            .image = image,
+            .x = x,
+            .y = y,
+            .width = width,
+            .height = height,
+    };
+    return true;
+}
+
+bool miniwl_render_job_add_fill(struct miniwl_render_job *job, int x, int y, int width, int height, uint32_t color)
+{
+    struct miniwl_render_item *item = wl_array_add(&job->items, sizeof(*item));
+    if (item == NULL)
+    {
+        return false;
+    }
+    *item = (struct miniwl_render_item){
+            .x = x,
+            .y = y,
+            .width = width,
+            .height = height,
+            .color = color,
+    };
+    return true;
+}
+
+void miniwl_render_pool_submit(struct miniwl_render_pool *pool, struct miniwl_render_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    job->finished = false;
+    wl_list_insert(&pool->pending, &job->link);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void miniwl_render_pool_wait(struct miniwl_render_pool *pool, struct miniwl_render_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!job->finished)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    wl_list_remove(&job->link);
+    wl_list_init(&job->link);
+    pthread_mutex_unlock(&pool->lock);
+}
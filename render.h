@@ -0,0 +1,68 @@
+#ifndef MINIWL_RENDER_H
+#define MINIWL_RENDER_H
+
+#include <pixman.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <wayland-server-core.h>
+#include "composite.h"
+
+/* A worker pool compositing output frames with pixman. The main thread
+ * snapshots everything a job needs into it, workers only touch the job, and
+ * the done callback runs back on the event loop thread. */
+
+struct miniwl_render_item
+{
+    /* NULL for a solid fill of color, premultiplied a8r8g8b8. */
+    pixman_image_t *image;
+    int x, y;
+    /* Integer upscale factor, only for formats with a composite kernel; 0
+     * when the image carries its own pixman transform from the target's
+     * width x height box into the source. */
+    int scale;
+    int width, height;
+    uint32_t color;
+};
+
+struct miniwl_render_job
+{
+    struct wl_list link;
+    pixman_image_t *target;
+    pixman_region32_t damage;
+    struct wl_array items;
+    bool finished;
+
+    void (*done)(struct miniwl_render_job *job, void *data);
+    void *data;
+};
+
+struct miniwl_render_pool
+{
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t finished;
+    struct wl_list pending;
+    struct wl_list done;
+    bool stopping;
+    const struct miniwl_composite_ops *composite;
+
+    int notify_fd;
+    struct wl_event_source *notify_source;
+};
+
+bool miniwl_render_pool_init(struct miniwl_render_pool *pool, struct wl_event_loop *loop, int nthreads);
+void miniwl_render_pool_finish(struct miniwl_render_pool *pool);
+
+void miniwl_render_job_init(struct miniwl_render_job *job);
+void miniwl_render_job_finish(struct miniwl_render_job *job);
+bool miniwl_render_job_add_item(struct miniwl_render_job *job, pixman_image_t *image, int x, int y, int scale);
+bool miniwl_render_job_add_transformed(struct miniwl_render_job *job, pixman_image_t *image,
+        int x, int y, int width, int height);
+bool miniwl_render_job_add_fill(struct miniwl_render_job *job, int x, int y, int width, int height, uint32_t color);
+void miniwl_render_pool_submit(struct miniwl_render_pool *pool, struct miniwl_render_job *job);
+/* Blocks until the job has run and takes it back without calling done. */
+void miniwl_render_pool_wait(struct miniwl_render_pool *pool, struct miniwl_render_job *job);
+
+#endif
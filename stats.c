@@ -0,0 +1,530 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+#include "stats.h"
+
+struct stats_client
+{
+    struct miniwl_stats *stats;
+    int fd;
+    struct wl_event_source *source;
+    char request[256];
+    size_t request_len;
+    char *response;
+    size_t response_len, response_pos;
+};
+
+static const char *input_names[MINIWL_INPUT_KIND_COUNT] = {
+        [MINIWL_INPUT_MOTION] = "cursor_motion",
+        [MINIWL_INPUT_KEY] = "key",
+};
+
+static const char *dispatch_names[MINIWL_DISPATCH_KIND_COUNT] = {
+        [MINIWL_DISPATCH_BACKEND] = "backend",
+        [MINIWL_DISPATCH_CLIENTS] = "clients",
+};
+
+uint64_t miniwl_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void miniwl_histogram_add(struct miniwl_histogram *histogram, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= MINIWL_HISTOGRAM_BUCKETS)
+    {
+        bucket = MINIWL_HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum_ns += ns;
+}
+
+void miniwl_stats_add_output(struct miniwl_stats *stats, struct miniwl_output_stats *output, const char *name)
+{
+    snprintf(output->name, sizeof(output->name), "%s", name);
+    wl_list_insert(stats->outputs.prev, &output->link);
+}
+
+void miniwl_stats_remove_output(struct miniwl_output_stats *output)
+{
+    wl_list_remove(&output->link);
+}
+
+void miniwl_stats_add_view(struct miniwl_stats *stats, struct miniwl_view_stats *view, uint32_t id)
+{
+    view->id = id;
+    wl_list_insert(stats->views.prev, &view->link);
+}
+
+void miniwl_stats_remove_view(struct miniwl_view_stats *view)
+{
+    wl_list_remove(&view->link);
+}
+
+struct miniwl_frame_sample *miniwl_output_stats_begin_frame(struct miniwl_output_stats *output)
+{
+    struct miniwl_frame_sample *sample = &output->ring[output->ring_head % MINIWL_STATS_FRAME_RING];
+    *sample = (struct miniwl_frame_sample){
+            .begin_ns = miniwl_stats_now(),
+    };
+    return sample;
+}
+
+void miniwl_output_stats_end_frame(struct miniwl_output_stats *output, struct miniwl_frame_sample *sample)
+{
+    sample->commit_end_ns = miniwl_stats_now();
+    output->frames++;
+    output->surfaces += sample->surfaces;
+    output->deferred += sample->deferred;
+    output->scanout_candidates += sample->scanout_candidate;
+    output->scanouts += sample->scanout;
+    if (!sample->committed)
+    {
+        output->skipped++;
+        sample->render_end_ns = sample->commit_end_ns;
+    }
+    else
+    {
+        miniwl_histogram_add(&output->render, sample->render_end_ns - sample->begin_ns);
+        miniwl_histogram_add(&output->commit, sample->commit_end_ns - sample->render_end_ns);
+    }
+    miniwl_histogram_add(&output->frame, sample->commit_end_ns - sample->begin_ns);
+    output->ring_head++;
+}
+
+void miniwl_output_stats_present(struct miniwl_output_stats *output, struct miniwl_frame_sample *sample,
+        uint64_t refresh_ns)
+{
+    /* A frame committed in time shows on the first vblank after its commit;
+     * every further refresh it waited is a missed frame. */
+    uint64_t latency = sample->present_ns > sample->commit_end_ns ? sample->present_ns - sample->commit_end_ns : 0;
+    miniwl_histogram_add(&output->present, latency);
+    output->presented++;
+    if (refresh_ns != 0)
+    {
+        output->missed += latency / refresh_ns;
+    }
+}
+
+void miniwl_stats_wakeup(struct miniwl_stats *stats, uint64_t now_ns)
+{
+    if (stats->track_wakeup && stats->wakeup_ns == 0)
+    {
+        stats->wakeup_ns = now_ns;
+    }
+}
+
+void miniwl_stats_record_input(struct miniwl_stats *stats, enum miniwl_input_kind kind, uint64_t begin_ns)
+{
+    miniwl_stats_wakeup(stats, begin_ns);
+    struct miniwl_input_sample *sample = &stats->input_ring[stats->input_head++ % MINIWL_STATS_INPUT_RING];
+    sample->begin_ns = begin_ns;
+    sample->end_ns = miniwl_stats_now();
+    sample->kind = kind;
+    miniwl_histogram_add(&stats->input[kind], sample->end_ns - begin_ns);
+    if (stats->wakeup_ns != 0 && begin_ns >= stats->wakeup_ns)
+    {
+        miniwl_histogram_add(&stats->input_delay[kind], begin_ns - stats->wakeup_ns);
+    }
+}
+
+static void write_histogram(FILE *f, const char *name, const char *labels, struct miniwl_histogram *histogram)
+{
+    uint64_t cumulative = 0;
+    for (int i = 0; i < MINIWL_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        cumulative += histogram->buckets[i];
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, labels[0] ? "," : "",
+                (double)(1ull << i) / 1e6, (unsigned long)cumulative);
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, labels[0] ? "," : "",
+            (unsigned long)histogram->count);
+    fprintf(f, "%s_sum{%s} %.9f\n", name, labels, histogram->sum_ns / 1e9);
+    fprintf(f, "%s_count{%s} %lu\n", name, labels, (unsigned long)histogram->count);
+}
+
+static void write_metrics(struct miniwl_stats *stats, FILE *f)
+{
+    static const struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } histograms[] = {
+            { "miniwl_frame_render_seconds", "Time from the frame event until the output buffer was rendered.",
+                    offsetof(struct miniwl_output_stats, render) },
+            { "miniwl_frame_commit_seconds", "Time spent committing the rendered buffer to the output.",
+                    offsetof(struct miniwl_output_stats, commit) },
+            { "miniwl_frame_seconds", "Total time spent handling an output frame event.",
+                    offsetof(struct miniwl_output_stats, frame) },
+            { "miniwl_frame_latch_seconds", "Time from the frame event until rendering started.",
+                    offsetof(struct miniwl_output_stats, latch) },
+            { "miniwl_frame_present_seconds", "Time from committing a frame until it was presented.",
+                    offsetof(struct miniwl_output_stats, present) },
+    };
+    static const struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+            { "miniwl_frames_total", "Output frame events handled.",
+                    offsetof(struct miniwl_output_stats, frames) },
+            { "miniwl_frames_skipped_total", "Frame events which had nothing to commit.",
+                    offsetof(struct miniwl_output_stats, skipped) },
+            { "miniwl_surfaces_drawn_total", "Surfaces shown on the output, summed over frames.",
+                    offsetof(struct miniwl_output_stats, surfaces) },
+            { "miniwl_frame_callbacks_deferred_total",
+                    "Surfaces shown on the output whose frame callbacks come from another output.",
+                    offsetof(struct miniwl_output_stats, deferred) },
+            { "miniwl_scanout_candidates_total", "Frames where a single buffer covered the whole output.",
+                    offsetof(struct miniwl_output_stats, scanout_candidates) },
+            { "miniwl_scanout_total", "Frames where a client buffer was scanned out directly.",
+                    offsetof(struct miniwl_output_stats, scanouts) },
+            { "miniwl_frame_deadline_missed_total", "Late-latched frames presented after the vblank they aimed for.",
+                    offsetof(struct miniwl_output_stats, deadline_misses) },
+            { "miniwl_frames_presented_total", "Committed frames which were presented.",
+                    offsetof(struct miniwl_output_stats, presented) },
+            { "miniwl_frames_missed_total", "Refreshes committed frames waited past the first vblank after the commit.",
+                    offsetof(struct miniwl_output_stats, missed) },
+            { "miniwl_frames_discarded_total", "Committed frames which were never presented.",
+                    offsetof(struct miniwl_output_stats, discarded) },
+    };
+
+    char labels[64];
+    struct miniwl_output_stats *output;
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++)
+    {
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", histograms[i].name, histograms[i].help, histograms[i].name);
+        wl_list_for_each(output, &stats->outputs, link)
+        {
+            snprintf(labels, sizeof(labels), "output=\"%s\"", output->name);
+            write_histogram(f, histograms[i].name, labels,
+                    (struct miniwl_histogram *)((char *)output + histograms[i].offset));
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", counters[i].name, counters[i].help, counters[i].name);
+        wl_list_for_each(output, &stats->outputs, link)
+        {
+            fprintf(f, "%s{output=\"%s\"} %lu\n", counters[i].name, output->name,
+                    (unsigned long)*(uint64_t *)((char *)output + counters[i].offset));
+        }
+    }
+
+    static const char *view_counters[][2] = {
+            { "miniwl_view_frames_total", "Output frames in which a toplevel's frame callbacks were sent." },
+            { "miniwl_view_frames_throttled_total",
+                    "Output frames in which a toplevel's frame callbacks were held back by the frame budget." },
+    };
+    struct miniwl_view_stats *view;
+    for (size_t i = 0; i < sizeof(view_counters) / sizeof(view_counters[0]); i++)
+    {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", view_counters[i][0], view_counters[i][1], view_counters[i][0]);
+        wl_list_for_each(view, &stats->views, link)
+        {
+            /* app_id comes from the client; keep it from breaking the label. */
+            char app_id[sizeof(view->app_id)];
+            size_t j;
+            for (j = 0; view->app_id[j] != '\0'; j++)
+            {
+                app_id[j] = view->app_id[j] == '"' || view->app_id[j] == '\\' || view->app_id[j] == '\n' ?
+                        '_' : view->app_id[j];
+            }
+            app_id[j] = '\0';
+            fprintf(f, "%s{view=\"%u\",app_id=\"%s\"} %lu\n", view_counters[i][0], view->id, app_id,
+                    (unsigned long)(i == 0 ? view->frames : view->throttled));
+        }
+    }
+
+    fprintf(f, "# HELP miniwl_input_seconds Time spent handling an input event.\n# TYPE miniwl_input_seconds histogram\n");
+    for (int kind = 0; kind < MINIWL_INPUT_KIND_COUNT; kind++)
+    {
+        snprintf(labels, sizeof(labels), "event=\"%s\"", input_names[kind]);
+        write_histogram(f, "miniwl_input_seconds", labels, &stats->input[kind]);
+    }
+
+    fprintf(f, "# HELP miniwl_input_dispatch_delay_seconds Time from the event loop waking up until an input "
+            "event was handled.\n# TYPE miniwl_input_dispatch_delay_seconds histogram\n");
+    for (int kind = 0; kind < MINIWL_INPUT_KIND_COUNT; kind++)
+    {
+        snprintf(labels, sizeof(labels), "event=\"%s\"", input_names[kind]);
+        write_histogram(f, "miniwl_input_dispatch_delay_seconds", labels, &stats->input_delay[kind]);
+    }
+
+    fprintf(f, "# HELP miniwl_dispatch_seconds Time spent dispatching one event loop pass.\n"
+            "# TYPE miniwl_dispatch_seconds histogram\n");
+    for (int kind = 0; kind < MINIWL_DISPATCH_KIND_COUNT; kind++)
+    {
+        snprintf(labels, sizeof(labels), "loop=\"%s\"", dispatch_names[kind]);
+        write_histogram(f, "miniwl_dispatch_seconds", labels, &stats->dispatch[kind]);
+    }
+
+    fprintf(f, "# HELP miniwl_resize_configure_seconds Time from an interactive resize configure until the client "
+            "committed it.\n# TYPE miniwl_resize_configure_seconds histogram\n");
+    write_histogram(f, "miniwl_resize_configure_seconds", "", &stats->resize);
+    fprintf(f, "# HELP miniwl_resize_configures_dropped_total Interactive resize sizes superseded before they "
+            "were sent.\n# TYPE miniwl_resize_configures_dropped_total counter\n");
+    fprintf(f, "miniwl_resize_configures_dropped_total %lu\n", (unsigned long)stats->resize_dropped);
+    fprintf(f, "# HELP miniwl_view_cache_builds_total Surface trees flattened for the render pool.\n"
+            "# TYPE miniwl_view_cache_builds_total counter\n");
+    fprintf(f, "miniwl_view_cache_builds_total %lu\n", (unsigned long)stats->cache_builds);
+    fprintf(f, "# HELP miniwl_view_cache_draws_total Flattened surface trees drawn in place of their surfaces.\n"
+            "# TYPE miniwl_view_cache_draws_total counter\n");
+    fprintf(f, "miniwl_view_cache_draws_total %lu\n", (unsigned long)stats->cache_draws);
+}
+
+static void write_trace(struct miniwl_stats *stats, FILE *f)
+{
+    /* Chrome trace event format: one thread per output, input on tid 0. */
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"input\"}}");
+
+    int tid = 1;
+    struct miniwl_output_stats *output;
+    wl_list_for_each(output, &stats->outputs, link)
+    {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                tid, output->name);
+        uint64_t count = output->ring_head < MINIWL_STATS_FRAME_RING ? output->ring_head : MINIWL_STATS_FRAME_RING;
+        for (uint64_t i = output->ring_head - count; i < output->ring_head; i++)
+        {
+            struct miniwl_frame_sample *sample = &output->ring[i % MINIWL_STATS_FRAME_RING];
+            fprintf(f, ",\n{\"name\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"surfaces\":%u,\"deferred\":%u,\"committed\":%s,\"scanout\":%s}}",
+                    tid, sample->begin_ns / 1e3, (sample->render_end_ns - sample->begin_ns) / 1e3,
+                    sample->surfaces, sample->deferred, sample->committed ? "true" : "false",
+                    sample->scanout ? "true" : "false");
+            if (sample->committed)
+            {
+                fprintf(f, ",\n{\"name\":\"commit\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        tid, sample->render_end_ns / 1e3, (sample->commit_end_ns - sample->render_end_ns) / 1e3);
+            }
+            if (sample->present_ns != 0)
+            {
+                fprintf(f, ",\n{\"name\":\"present\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                        tid, sample->present_ns / 1e3);
+            }
+        }
+        tid++;
+    }
+
+    uint64_t count = stats->input_head < MINIWL_STATS_INPUT_RING ? stats->input_head : MINIWL_STATS_INPUT_RING;
+    for (uint64_t i = stats->input_head - count; i < stats->input_head; i++)
+    {
+        struct miniwl_input_sample *sample = &stats->input_ring[i % MINIWL_STATS_INPUT_RING];
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+                input_names[sample->kind], sample->begin_ns / 1e3, (sample->end_ns - sample->begin_ns) / 1e3);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+static void stats_client_destroy(struct stats_client *client)
+{
+    wl_event_source_remove(client->source);
+    close(client->fd);
+    free(client->response);
+    free(client);
+}
+
+static bool stats_client_respond(struct stats_client *client)
+{
+    /* Requests are either a bare "metrics"/"trace" line or an HTTP GET for
+     * /metrics or /trace, so Prometheus can scrape through a socket proxy. */
+    bool http = strncmp(client->request, "GET ", 4) == 0;
+    const char *target = http ? client->request + 4 : client->request;
+    if (*target == '/')
+    {
+        target++;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f = open_memstream(&body, &body_len);
+    if (f == NULL)
+    {
+        return false;
+    }
+    const char *content_type = "text/plain; version=0.0.4";
+    bool found = true;
+    if (strncmp(target, "trace", 5) == 0)
+    {
+        write_trace(client->stats, f);
+        content_type = "application/json";
+    }
+    else if (strncmp(target, "metrics", 7) == 0 || (http && (*target == ' ' || *target == '\r')))
+    {
+        write_metrics(client->stats, f);
+    }
+    else
+    {
+        fprintf(f, "unknown request, expected \"metrics\" or \"trace\"\n");
+        found = false;
+    }
+    fclose(f);
+
+    f = open_memstream(&client->response, &client->response_len);
+    if (f == NULL)
+    {
+        free(body);
+        return false;
+    }
+    if (http)
+    {
+        fprintf(f, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                found ? "200 OK" : "404 Not Found", content_type, body_len);
+    }
+    fwrite(body, 1, body_len, f);
+    fclose(f);
+    free(body);
+    return true;
+}
+
+static int stats_client_handle(int fd, uint32_t mask, void *data)
+{
+    struct stats_client *client = data;
+    if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR))
+    {
+        stats_client_destroy(client);
+        return 0;
+    }
+
+    if (client->response == NULL && (mask & WL_EVENT_READABLE))
+    {
+        ssize_t n = read(fd, client->request + client->request_len,
+                sizeof(client->request) - 1 - client->request_len);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EAGAIN)
+            {
+                return 0;
+            }
+            stats_client_destroy(client);
+            return 0;
+        }
+        client->request_len += n;
+        client->request[client->request_len] = '\0';
+        if (strchr(client->request, '\n') == NULL && client->request_len < sizeof(client->request) - 1)
+        {
+            return 0;
+        }
+        if (!stats_client_respond(client))
+        {
+            stats_client_destroy(client);
+            return 0;
+        }
+        wl_event_source_fd_update(client->source, WL_EVENT_WRITABLE);
+    }
+
+    if (client->response != NULL && (mask & WL_EVENT_WRITABLE))
+    {
+        ssize_t n = write(fd, client->response + client->response_pos,
+                client->response_len - client->response_pos);
+        if (n < 0 && errno == EAGAIN)
+        {
+            return 0;
+        }
+        if (n > 0)
+        {
+            client->response_pos += n;
+        }
+        if (n <= 0 || client->response_pos == client->response_len)
+        {
+            stats_client_destroy(client);
+        }
+    }
+    return 0;
+}
+
+static int stats_handle_accept(int fd, uint32_t mask, void *data)
+{
+    struct miniwl_stats *stats = data;
+    int client_fd = accept(fd, NULL, NULL);
+    if (client_fd < 0)
+    {
+        return 0;
+    }
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+
+    struct stats_client *client = calloc(1, sizeof(struct stats_client));
+    if (client == NULL)
+    {
+        close(client_fd);
+        return 0;
+    }
+    client->stats = stats;
+    client->fd = client_fd;
+    client->source = wl_event_loop_add_fd(stats->loop, client_fd, WL_EVENT_READABLE, stats_client_handle, client);
+    if (client->source == NULL)
+    {
+        close(client_fd);
+        free(client);
+    }
+    return 0;
+}
+
+void miniwl_stats_init(struct miniwl_stats *stats, struct wl_event_loop *loop)
+{
+    stats->loop = loop;
+    stats->listen_fd = -1;
+    wl_list_init(&stats->outputs);
+    wl_list_init(&stats->views);
+}
+
+bool miniwl_stats_listen(struct miniwl_stats *stats, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        wlr_log(WLR_ERROR, "Stats socket path too long: %s", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to listen on stats socket %s", path);
+        close(fd);
+        return false;
+    }
+
+    stats->listen_fd = fd;
+    stats->listen_source = wl_event_loop_add_fd(stats->loop, fd, WL_EVENT_READABLE, stats_handle_accept, stats);
+    snprintf(stats->path, sizeof(stats->path), "%s", path);
+    return true;
+}
+
+void miniwl_stats_finish(struct miniwl_stats *stats)
+{
+    if (stats->listen_fd < 0)
+    {
+        return;
+    }
+    wl_event_source_remove(stats->listen_source);
+    close(stats->listen_fd);
+    unlink(stats->path);
+    stats->listen_fd = -1;
+}
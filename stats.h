@@ -0,0 +1,140 @@
+#ifndef MINIWL_STATS_H
+#define MINIWL_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-server-core.h>
+
+/* Histogram bucket i counts samples below 2^i microseconds; the last bucket
+ * is +Inf. */
+#define MINIWL_HISTOGRAM_BUCKETS 24
+#define MINIWL_STATS_FRAME_RING 256
+#define MINIWL_STATS_INPUT_RING 1024
+
+enum miniwl_input_kind
+{
+    MINIWL_INPUT_MOTION,
+    MINIWL_INPUT_KEY,
+    MINIWL_INPUT_KIND_COUNT,
+};
+
+enum miniwl_dispatch_kind
+{
+    MINIWL_DISPATCH_BACKEND,
+    MINIWL_DISPATCH_CLIENTS,
+    MINIWL_DISPATCH_KIND_COUNT,
+};
+
+struct miniwl_histogram
+{
+    uint64_t buckets[MINIWL_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+struct miniwl_frame_sample
+{
+    uint64_t begin_ns;
+    uint64_t render_end_ns;
+    uint64_t commit_end_ns;
+    uint64_t present_ns;
+    uint32_t surfaces;
+    uint32_t deferred;
+    bool committed;
+    bool scanout_candidate;
+    bool scanout;
+};
+
+struct miniwl_input_sample
+{
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    enum miniwl_input_kind kind;
+};
+
+/* All samples are written from the event loop thread only; the rings are
+ * single-writer and readers never block the writer. */
+struct miniwl_output_stats
+{
+    struct wl_list link;
+    char name[32];
+    struct miniwl_histogram render;
+    struct miniwl_histogram commit;
+    struct miniwl_histogram frame;
+    struct miniwl_histogram latch;
+    struct miniwl_histogram present;
+    uint64_t frames;
+    uint64_t skipped;
+    uint64_t surfaces;
+    uint64_t deferred;
+    uint64_t scanout_candidates;
+    uint64_t scanouts;
+    uint64_t deadline_misses;
+    uint64_t presented;
+    uint64_t missed;
+    uint64_t discarded;
+    struct miniwl_frame_sample ring[MINIWL_STATS_FRAME_RING];
+    uint64_t ring_head;
+};
+
+/* Frame callbacks per toplevel; throttled counts the output frames whose
+ * callbacks were held back by the unfocused frame budget. */
+struct miniwl_view_stats
+{
+    struct wl_list link;
+    uint32_t id;
+    char app_id[64];
+    uint64_t frames;
+    uint64_t throttled;
+};
+
+struct miniwl_stats
+{
+    struct wl_event_loop *loop;
+    struct wl_event_source *listen_source;
+    int listen_fd;
+    char path[108];
+
+    struct wl_list outputs;
+    struct wl_list views;
+    struct miniwl_histogram input[MINIWL_INPUT_KIND_COUNT];
+    /* Time from the event loop waking up until an input handler ran, i.e.
+     * how long the event queued behind other work of the same dispatch.
+     * Only the -P loop tracks its wakeups, so this and dispatch stay empty
+     * without it. */
+    struct miniwl_histogram input_delay[MINIWL_INPUT_KIND_COUNT];
+    struct miniwl_histogram dispatch[MINIWL_DISPATCH_KIND_COUNT];
+    bool track_wakeup;
+    uint64_t wakeup_ns;
+    struct miniwl_histogram resize;
+    uint64_t resize_dropped;
+    uint64_t cache_builds;
+    uint64_t cache_draws;
+    struct miniwl_input_sample input_ring[MINIWL_STATS_INPUT_RING];
+    uint64_t input_head;
+};
+
+uint64_t miniwl_stats_now(void);
+void miniwl_histogram_add(struct miniwl_histogram *histogram, uint64_t ns);
+
+void miniwl_stats_init(struct miniwl_stats *stats, struct wl_event_loop *loop);
+bool miniwl_stats_listen(struct miniwl_stats *stats, const char *path);
+void miniwl_stats_finish(struct miniwl_stats *stats);
+
+void miniwl_stats_add_output(struct miniwl_stats *stats, struct miniwl_output_stats *output, const char *name);
+void miniwl_stats_remove_output(struct miniwl_output_stats *output);
+struct miniwl_frame_sample *miniwl_output_stats_begin_frame(struct miniwl_output_stats *output);
+void miniwl_output_stats_end_frame(struct miniwl_output_stats *output, struct miniwl_frame_sample *sample);
+/* Records when a committed frame was presented, with present_ns set. */
+void miniwl_output_stats_present(struct miniwl_output_stats *output, struct miniwl_frame_sample *sample,
+        uint64_t refresh_ns);
+
+void miniwl_stats_add_view(struct miniwl_stats *stats, struct miniwl_view_stats *view, uint32_t id);
+void miniwl_stats_remove_view(struct miniwl_view_stats *view);
+
+/* Notes that a source of the backend loop ran; the first one in a pass
+ * stands for the wakeup, until the pass ends and wakeup_ns is cleared. */
+void miniwl_stats_wakeup(struct miniwl_stats *stats, uint64_t now_ns);
+void miniwl_stats_record_input(struct miniwl_stats *stats, enum miniwl_input_kind kind, uint64_t begin_ns);
+
+#endif
@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "binlog.h"
+
+/* miniwl-logdump: prints the records of a miniwl -B binary log, oldest
+ * first, formatting each one with the printf format it was logged with. */
+
+static const char *importance_names[] = { "SILENT", "ERROR", "INFO", "DEBUG" };
+
+static bool take(const struct miniwl_binlog_record *record, uint32_t *pos, uint64_t *value)
+{
+    if (*pos + sizeof(*value) > record->len)
+    {
+        return false;
+    }
+    memcpy(value, record->payload + *pos, sizeof(*value));
+    *pos += sizeof(*value);
+    return true;
+}
+
+static void print_record(const struct miniwl_binlog_record *record, const char *fmt)
+{
+    /* Each conversion is handed back to printf on its own, with the length
+     * modifier rewritten to the 64-bit type it was stored as. */
+    uint32_t pos = 0;
+    const char *c = fmt;
+    while (*c != '\0')
+    {
+        const char *percent = strchr(c, '%');
+        if (percent == NULL)
+        {
+            fputs(c, stdout);
+            break;
+        }
+        fwrite(c, 1, percent - c, stdout);
+        c = percent + 1;
+        if (*c == '%')
+        {
+            putchar('%');
+            c++;
+            continue;
+        }
+
+        char spec[64] = "%";
+        size_t len = 1;
+        size_t flags = strspn(c, "-+ #0'");
+        memcpy(spec + len, c, flags);
+        len += flags;
+        c += flags;
+        uint64_t value;
+        for (int part = 0; part < 2; part++)
+        {
+            if (part == 1)
+            {
+                if (*c != '.')
+                {
+                    break;
+                }
+                spec[len++] = *c++;
+            }
+            if (*c == '*')
+            {
+                if (!take(record, &pos, &value))
+                {
+                    goto truncated;
+                }
+                len += snprintf(spec + len, sizeof(spec) - len - 8, "%d", (int)(int64_t)value);
+                c++;
+            }
+            size_t digits = strspn(c, "0123456789");
+            if (len + digits + 8 > sizeof(spec))
+            {
+                goto truncated;
+            }
+            memcpy(spec + len, c, digits);
+            len += digits;
+            c += digits;
+        }
+        c += strspn(c, "hlLzjt");
+        char conversion = *c;
+        if (conversion == '\0')
+        {
+            break;
+        }
+        c++;
+
+        if (conversion == 's')
+        {
+            const char *s = (const char *)record->payload + pos;
+            size_t n = pos < record->len ? strnlen(s, record->len - pos) : 0;
+            if (pos >= record->len || n == record->len - pos)
+            {
+                goto truncated;
+            }
+            spec[len++] = 's';
+            spec[len] = '\0';
+            printf(spec, s);
+            pos += n + 1;
+            continue;
+        }
+        if (!take(record, &pos, &value))
+        {
+            goto truncated;
+        }
+        switch (conversion)
+        {
+            case 'd':
+            case 'i':
+                memcpy(spec + len, "ll", 2);
+                spec[len + 2] = conversion;
+                spec[len + 3] = '\0';
+                printf(spec, (long long)value);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                memcpy(spec + len, "ll", 2);
+                spec[len + 2] = conversion;
+                spec[len + 3] = '\0';
+                printf(spec, (unsigned long long)value);
+                break;
+            case 'c':
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                printf(spec, (int)value);
+                break;
+            case 'p':
+                spec[len++] = 'p';
+                spec[len] = '\0';
+                printf(spec, (void *)(uintptr_t)value);
+                break;
+            default:
+            {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                spec[len++] = conversion;
+                spec[len] = '\0';
+                printf(spec, d);
+                break;
+            }
+        }
+    }
+    if (record->flags & MINIWL_BINLOG_TRUNCATED)
+    {
+        goto truncated;
+    }
+    return;
+
+truncated:
+    fputs(" [truncated]", stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <binary log>\n", argv[0]);
+        return 1;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    const struct miniwl_binlog_header *header = NULL;
+    if ((size_t)st.st_size >= sizeof(*header))
+    {
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (header == NULL || header == MAP_FAILED || memcmp(header->magic, MINIWL_BINLOG_MAGIC, sizeof(header->magic)) != 0 ||
+            header->record_size != sizeof(struct miniwl_binlog_record) ||
+            sizeof(*header) + (size_t)header->format_count * header->format_size +
+            (size_t)header->record_count * header->record_size > (size_t)st.st_size)
+    {
+        fprintf(stderr, "%s: not a miniwl binary log\n", argv[1]);
+        return 1;
+    }
+
+    const char *formats = (const char *)(header + 1);
+    const struct miniwl_binlog_record *records = (const struct miniwl_binlog_record *)(formats +
+            (size_t)header->format_count * header->format_size);
+    uint64_t head = header->head;
+    uint64_t first = head > header->record_count ? head - header->record_count : 1;
+    printf("# miniwl pid %u, records %lu to %lu\n", header->pid, (unsigned long)first, (unsigned long)head - 1);
+
+    for (uint64_t seq = first; seq < head; seq++)
+    {
+        const struct miniwl_binlog_record *record = &records[seq % header->record_count];
+        if (record->seq != seq || record->len > sizeof(record->payload))
+        {
+            continue;
+        }
+        uint64_t ns = header->realtime_ns + (record->time_ns - header->monotonic_ns);
+        time_t secs = ns / 1000000000;
+        struct tm tm;
+        char stamp[32];
+        localtime_r(&secs, &tm);
+        strftime(stamp, sizeof(stamp), "%F %T", &tm);
+        printf("%s.%06lu [%s] ", stamp, (unsigned long)(ns % 1000000000 / 1000),
+                record->importance < sizeof(importance_names) / sizeof(importance_names[0]) ?
+                importance_names[record->importance] : "?");
+
+        if (record->format == MINIWL_BINLOG_FORMATTED)
+        {
+            printf("%.*s", (int)strnlen((const char *)record->payload, record->len), (const char *)record->payload);
+            if (record->flags & MINIWL_BINLOG_TRUNCATED)
+            {
+                fputs(" [truncated]", stdout);
+            }
+        }
+        else if (record->format < header->formats_used && record->format < header->format_count)
+        {
+            const char *fmt = formats + (size_t)record->format * header->format_size;
+            char copy[MINIWL_BINLOG_FORMAT_SIZE + 1];
+            snprintf(copy, sizeof(copy), "%.*s", (int)strnlen(fmt, header->format_size), fmt);
+            print_record(record, copy);
+        }
+        else
+        {
+            printf("(unknown format %u)", record->format);
+        }
+        putchar('\n');
+    }
+    return 0;
+}
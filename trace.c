@@ -0,0 +1,44 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <wlr/util/log.h>
+#include "stats.h"
+#include "trace.h"
+
+bool miniwl_trace_open(struct miniwl_trace *trace, const char *path)
+{
+    trace->f = fopen(path, "we");
+    if (trace->f == NULL)
+    {
+        wlr_log_errno(WLR_ERROR, "Failed to open trace %s", path);
+        return false;
+    }
+    /* Events are small and frequent; let stdio batch them. */
+    setvbuf(trace->f, NULL, _IOFBF, 1 << 16);
+    trace->start_ns = miniwl_stats_now();
+    fprintf(trace->f, "# miniwl trace 1\n");
+    return true;
+}
+
+void miniwl_trace_close(struct miniwl_trace *trace)
+{
+    if (trace->f == NULL)
+    {
+        return;
+    }
+    fclose(trace->f);
+    trace->f = NULL;
+}
+
+void miniwl_trace_event(struct miniwl_trace *trace, const char *fmt, ...)
+{
+    if (trace->f == NULL)
+    {
+        return;
+    }
+    fprintf(trace->f, "%.3f ", (miniwl_stats_now() - trace->start_ns) / 1e6);
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(trace->f, fmt, args);
+    va_end(args);
+    fputc('\n', trace->f);
+}
@@ -0,0 +1,37 @@
+#ifndef MINIWL_TRACE_H
+#define MINIWL_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Workload recording for miniwl-bench -P. One event per line: milliseconds
+ * since the recording started, the event name and its arguments.
+ *
+ *   device <keyboard|pointer> <name>
+ *   motion <dx> <dy>
+ *   motion_absolute <x> <y>            (0..1 across the layout)
+ *   button <button> <0|1>
+ *   axis <orientation> <delta> <discrete>
+ *   key <keycode> <0|1>
+ *   toplevel <id>
+ *   map <id> <width> <height>
+ *   unmap <id>
+ *   destroy <id>
+ *   fullscreen <id> <0|1>
+ *   commit <id> <width> <height> <x1> <y1> <x2> <y2> <rects>
+ *
+ * Commits carry the buffer size and the extents and rectangle count of the
+ * buffer damage; keycodes and buttons are evdev codes. */
+
+struct miniwl_trace
+{
+    FILE *f;
+    uint64_t start_ns;
+};
+
+bool miniwl_trace_open(struct miniwl_trace *trace, const char *path);
+void miniwl_trace_close(struct miniwl_trace *trace);
+void miniwl_trace_event(struct miniwl_trace *trace, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif